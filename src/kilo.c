@@ -19,14 +19,24 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -34,9 +44,15 @@
 /*** function prototypes ***/
 
 void closeLogFile();
-char *editorPrompt(char *prompt);
+int editorClientGone();
+int editorFollowPoll();
+void editorFollowWatch();
+void editorFreeUndo();
+int editorOpenArgs(int argc, char *argv[]);
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorRefreshScreen();
 void editorSetStatusMessage(const char *fmt, ...);
+void initEditor();
 void logm(const char *level, const char *func, int line, const char *format, ...);
 
 /*** defines ***/
@@ -46,7 +62,15 @@ void logm(const char *level, const char *func, int line, const char *format, ...
 #define MAX_MSG_LEN 512
 
 #define KILO_TAB_STOP 8
+#define KILO_LONG_LINE 65536 /* rows this long are edited without a rescan */
 #define KILO_DIRTY_QUIT_TIMES 0
+#define KILO_REPLACE_MAX_THREADS 16
+#define KILO_REPLACE_MIN_ROWS 4096 /* rows per thread before splitting */
+#define KILO_IOV_ROWS 512 /* rows handed to one pwritev call */
+#define KILO_RE_MAX_STATES 1024 /* cached DFA states before the cache is flushed */
+#define KILO_SOCKET_NAME "kilo.sock" /* in $XDG_RUNTIME_DIR */
+#define KILO_SOCKET_FMT "/tmp/kilo-%d.sock" /* filled in with the uid, without one */
+#define KILO_REQUEST_MAX (1 << 20) /* bytes of arguments a client may send */
 
 #define LOG_INFO(...) logm("INFO", __func__, __LINE__, __VA_ARGS__)
 #define LOG_DEBUG(...) logm("DEBUG", __func__, __LINE__, __VA_ARGS__)
@@ -74,13 +98,101 @@ int logfd; /* file descriptor for the log file */
 
 /*** data ***/
 
+/* Rows keep no rendered copy, the visible slice is expanded from chars when
+ * drawn, which keeps an erow at 32 bytes. */
 typedef struct erow {
+	char *chars;  /* points into the buffer's arena when loaded from disk */
+	off_t off;    /* where the row starts in the file, -1 if it isn't there */
 	int size;
-	int rsize;
-	char *chars;
-	char *render;
+	int rsize;    /* width on screen, with tabs expanded */
+	unsigned int tabs : 29;
+	unsigned int dirty : 1;   /* changed since the file was last read or saved */
+	unsigned int inarena : 1; /* chars is in the arena, don't free or realloc it */
+	unsigned int shared : 1;  /* chars belongs to the yank buffer, copy before writing */
 } erow;
 
+/* a column lookup in a long row, later lookups carry on from the nearest */
+typedef struct editorRxMark {
+	erow *row;
+	int cx;
+	int rx;
+} editorRxMark;
+
+/* a row as it was before a replace, kept so the replace can be undone */
+typedef struct editorUndoRow {
+	int at;
+	int size;
+	int inarena;
+	int shared;
+	char *chars;
+} editorUndoRow;
+
+/* per-file state, swapped in and out of E when switching buffers */
+typedef struct editorBuffer {
+	int cx, cy;
+	int rx;
+	int rowoff;
+	int coloff;
+	int numrows;
+	erow *row;
+	int dirty;
+	char *filename;
+	int loaded; /* 0 until the file is first shown */
+	int voff;
+	int *wrapidx;
+	int wrapvalid;
+	int wrapcols;
+	int follow;
+	off_t followoff;
+	ino_t followino;
+	struct timespec followmtime;
+	int followpartial;
+	char *arena;
+	size_t arenalen;
+} editorBuffer;
+
+/* regex automata, see the regex section */
+enum reNodeType {
+	RE_SET,   /* consumes one byte from set */
+	RE_EPS,   /* epsilon edges to out and out1, -1 when unused */
+	RE_MATCH
+};
+
+typedef struct reNode {
+	int type;
+	int out, out1;
+	unsigned char set[32];
+} reNode;
+
+/* A DFA built lazily from an NFA. States are sets of NFA nodes and are only
+ * created when a transition is first taken. */
+typedef struct reDfa {
+	reNode *nfa;
+	int nnodes;
+	int start;        /* NFA start node */
+	int unanchored;   /* a match may begin at every position */
+	int startstate;   /* DFA state for the start closure, -1 if not built */
+	int nstates;
+	int *trans;       /* nstates * 256 next states, -1 if not computed yet */
+	int *accept;
+	int *setoff;      /* where each state's node set is in pool */
+	int *setlen;
+	int *pool;
+	int poollen;
+	int *hash;        /* open addressing table from node sets to states */
+	int *mark;        /* scratch for building closures */
+	int gen;
+	int *buf;
+	int *stack;
+} reDfa;
+
+typedef struct regex {
+	reDfa fwd;  /* finds the longest match from a known start */
+	reDfa rev;  /* runs the reversed pattern backwards to find the start */
+	int bol, eol;
+	int maxlen; /* longest a match can be, -1 if unbounded */
+} regex;
+
 struct editorConfig {
 	int cx, cy;
 	int rx;
@@ -92,9 +204,55 @@ struct editorConfig {
 	erow *row;
 	int dirty;
 	char *filename;
+	editorBuffer *buf;
+	int numbufs;
+	int curbuf;
+	editorUndoRow *undo;
+	int undolen;
+	int undodirty; /* E.dirty right after the replace, undo is stale otherwise */
+	int mark; /* first row of the selection, -1 when nothing is marked */
+	erow *yank;
+	int yanklen;
+	int yankcut;  /* the yank holds cut rows that weren't pasted yet */
+	int yankbuf;  /* buffer the rows were cut from */
+	int yanklent; /* pasted rows still share chars with the yank */
+	int wrap;      /* soft wrap long rows instead of scrolling sideways */
+	int voff;      /* visual line at the top of the screen when wrapping */
+	int *wrapidx;  /* Fenwick tree over the visual lines of each row */
+	int wrapvalid; /* rows the index is built for, the rest are pending */
+	int wrapcols;  /* screencols the index was built for */
+	int follow;        /* pick up lines appended to the file, like tail -f */
+	off_t followoff;   /* bytes of the file already read into rows */
+	ino_t followino;   /* inode that was read, a new one means rotation */
+	struct timespec followmtime; /* its mtime once followoff bytes were in */
+	int followpartial; /* last row was not terminated by a newline yet */
+	int ifd;           /* inotify instance, watching the current buffer */
+	int iwd;
+	int idwd;          /* its directory, to see a rotated file reappear */
+	char *arena;     /* the file as read by editorOpen, holding rows' chars */
+	size_t arenalen;
+	editorRxMark rxmark[2]; /* where the cursor and the window were found */
+	erow *gaprow;    /* the long row being typed into, its chars have a gap */
+	int gapat;       /* chars from here on sit gaplen bytes further on */
+	int gaplen;
+	int gaptabs;     /* tabs before the gap */
+	int gapnext;     /* chars between the gap and the next tab, -1 if unknown */
+	char **shadow;   /* contents of each screen row as last drawn */
+	int *shadowlen;  /* -1 when a row's contents are unknown */
+	int shadowrows;
+	int shadowtop;   /* E.rowoff, or E.voff when wrapping, of the shadow */
+	int shadowwrap;
+	int shadowvalid; /* cleared to force a full repaint */
+	char *findquery; /* highlighted in the visible rows, NULL when not searching */
+	int findregex;   /* findquery is a regex rather than a literal */
+	regex *findre;   /* compiled findquery, NULL if it didn't parse */
+	char findprompt[64];
 	char statusmsg[80];
 	time_t statusmsg_time;
 	struct termios orig_termios;
+	int rawmode; /* orig_termios has to be restored */
+	int quit;    /* leave the main loop, to exit or detach the client */
+	int client;  /* socket of the attached client in server mode, or -1 */
 };
 
 struct editorConfig E;
@@ -113,14 +271,20 @@ void die(const char *s)
 
 void disableRawMode()
 {
+	if (!E.rawmode) return;
+	E.rawmode = 0;
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 }
 
-void enableRawMode()
+/* Returns -1 if the terminal can't be put in raw mode. */
+int enableRawMode()
 {
 	LOG_INFO("Enabling terminal raw mode...");
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
-	atexit(disableRawMode);
+	static int registered = 0;
+	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) return -1;
+	if (!registered) atexit(disableRawMode);
+	registered = 1;
+	E.rawmode = 1;
 
 	struct termios raw = E.orig_termios;
 	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -130,8 +294,9 @@ void enableRawMode()
 	raw.c_cc[VMIN] = 0;
 	raw.c_cc[VTIME] = 1;
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) return -1;
 	LOG_INFO("Enabled terminal raw mode.");
+	return 0;
 }
 
 int editorReadKey()
@@ -139,7 +304,16 @@ int editorReadKey()
 	int nread;
 	char c;
 	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+		/* a server outlives its clients' terminals, give up on the client */
+		if ((nread == -1 && errno != EAGAIN && E.client != -1) ||
+			(nread == 0 && editorClientGone())) {
+			E.quit = 1;
+			return '\x1b';
+		}
 		if (nread == -1 && errno != EAGAIN) die("read");
+
+		/* no key within VTIME, see if a followed file grew meanwhile */
+		if (nread == 0 && editorFollowPoll()) editorRefreshScreen();
 	}
 
 	if (c == '\x1b') {
@@ -235,248 +409,2405 @@ int getWindowSize(int *rows, int *cols)
 	}
 }
 
-/*** row operations ***/
-
-int editorRowCxToRx(erow *row, int cx)
-
+int editorUpdateWindowSize()
+{
+	if (getWindowSize(&E.screenrows, &E.screencols) == -1) return -1;
+	E.screenrows -= 2; /* For statusbar and msg */
+	return 0;
+}
+
+/*** soft wrap index ***/
+
+/* When wrapping, a row takes rsize / screencols + 1 visual lines. The counts
+ * are kept in a Fenwick tree so that editing a row costs O(log N) and so
+ * does mapping a visual line back to its row. Inserting or deleting rows
+ * shifts every index after them, so those only cut the tree back to the
+ * nodes before the splice, and it is extended again lazily, O(log N) per
+ * row. Appending rows at the end thus never rebuilds the rest. */
+
+int editorRowVlines(erow *row)
+{
+	return row->rsize / E.wrapcols + 1;
+}
+
+/* fill in the nodes for the rows from E.wrapvalid on */
+void editorWrapBuild()
+{
+	int n = E.numrows;
+	int i, j;
+
+	if (malloc_usable_size(E.wrapidx) < sizeof(int) * (n + 1)) {
+		E.wrapidx = realloc(E.wrapidx, sizeof(int) * (n + n / 8 + 1));
+		if (E.wrapidx == NULL) die("realloc");
+	}
+
+	/* a node holds its own row plus the nodes of the rows it covers */
+	E.wrapidx[0] = 0;
+	for (i = E.wrapvalid + 1; i <= n; i++) {
+		E.wrapidx[i] = editorRowVlines(&E.row[i - 1]);
+		for (j = i - 1; j > i - (i & -i); j -= j & -j)
+			E.wrapidx[i] += E.wrapidx[j];
+	}
+	if (n - E.wrapvalid > 1)
+		LOG_DEBUG("Built wrap index for rows %d to %d at %d columns.",
+				E.wrapvalid, n, E.wrapcols);
+	E.wrapvalid = n;
+}
+
+void editorWrapIndex()
+{
+	if (E.wrapcols != E.screencols) {
+		E.wrapcols = E.screencols;
+		E.wrapvalid = 0;
+	}
+	if (E.wrapvalid < E.numrows || E.wrapidx == NULL) editorWrapBuild();
+}
+
+/* the rows from `at` on moved, drop their nodes; a node only covers rows
+ * up to its own, so the ones before `at` stay right */
+void editorWrapCut(int at)
+{
+	if (E.wrapvalid > at) E.wrapvalid = at;
+}
+
+void editorWrapAdd(int at, int delta)
+{
+	for (at++; at <= E.wrapvalid; at += at & -at) E.wrapidx[at] += delta;
+}
+
+/* number of visual lines taken by the rows before `at` */
+int editorWrapPrefix(int at)
+{
+	int sum = 0;
+	for (; at > 0; at -= at & -at) sum += E.wrapidx[at];
+	return sum;
+}
+
+/* row containing visual line v, with the line within that row in *sub */
+int editorWrapFind(int v, int *sub)
+{
+	int step = 1, pos = 0;
+	while (step * 2 <= E.numrows) step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (pos + step <= E.numrows && E.wrapidx[pos + step] <= v) {
+			pos += step;
+			v -= E.wrapidx[pos];
+		}
+	}
+	if (sub) *sub = v;
+	return pos;
+}
+
+/* visual line of the cursor */
+int editorWrapCursor()
+{
+	int v = editorWrapPrefix(E.cy);
+	if (E.cy < E.numrows) v += E.rx / E.wrapcols;
+	return v;
+}
+
+void editorToggleWrap()
+{
+	E.wrap = !E.wrap;
+	if (E.wrap) {
+		editorWrapIndex();
+		E.voff = editorWrapPrefix(E.rowoff);
+	}
+	E.coloff = 0;
+	editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/*** row operations ***/
+
+/* Forget the marks in row past cx, or all of row's marks when cx is -1, or
+ * every mark when row is NULL. */
+void editorRxMarkDrop(erow *row, int cx)
+{
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (row == NULL || (E.rxmark[i].row == row && E.rxmark[i].cx > cx)) {
+			E.rxmark[i].row = NULL;
+			E.rxmark[i].cx = 0;
+			E.rxmark[i].rx = 0;
+		}
+	}
+}
+
+/* Start *cx, *rx at the furthest mark in row that is at most at cx, or at
+ * rx when cx is -1. Stays at the start of the row without one. */
+void editorRxMarkFind(erow *row, int cx, int rx, int *mcx, int *mrx)
+{
+	int i;
+	*mcx = *mrx = 0;
+	for (i = 0; i < 2; i++) {
+		editorRxMark *m = &E.rxmark[i];
+		if (m->row != row || m->cx < *mcx) continue;
+		if (cx == -1 ? m->rx <= rx : m->cx <= cx) {
+			*mcx = m->cx;
+			*mrx = m->rx;
+		}
+	}
+}
+
+/* Typing into a long row moves a gap along with the cursor instead of the
+ * rest of the row, so an edit costs as much as the cursor moved. Only one
+ * row has a gap, everything that wants the row's chars in one piece other
+ * than the drawing code closes it first. */
+
+/* where char j of row is */
+char *editorRowAt(erow *row, int j)
+{
+	if (row == E.gaprow && j >= E.gapat) return &row->chars[j + E.gaplen];
+	return &row->chars[j];
+}
+
+int editorCountTabs(char *s, int len)
+{
+	int n = 0;
+	char *end = s + len;
+	for (; (s = memchr(s, '\t', end - s)) != NULL; s++) n++;
+	return n;
+}
+
+/* move the gap to start before char at */
+void editorGapMove(int at)
+{
+	char *chars = E.gaprow->chars;
+	int n;
+
+	if (at < E.gapat) {
+		n = E.gapat - at;
+		memmove(&chars[at + E.gaplen], &chars[at], n);
+		char *tab = memchr(&chars[at + E.gaplen], '\t', n);
+		if (tab) {
+			E.gaptabs -= editorCountTabs(tab, &chars[E.gapat + E.gaplen] - tab);
+			E.gapnext = tab - &chars[at + E.gaplen];
+		} else if (E.gapnext != -1) {
+			E.gapnext += n;
+		}
+	} else if (at > E.gapat) {
+		n = at - E.gapat;
+		memmove(&chars[E.gapat], &chars[E.gapat + E.gaplen], n);
+		E.gaptabs += editorCountTabs(&chars[E.gapat], n);
+		E.gapnext = E.gapnext >= n ? E.gapnext - n : -1;
+	}
+	E.gapat = at;
+}
+
+/* put the chars of the row with the gap back in one piece */
+void editorGapClose()
+{
+	if (E.gaprow == NULL) return;
+	editorGapMove(E.gaprow->size);
+	E.gaprow->chars[E.gaprow->size] = '\0';
+	E.gaprow = NULL;
+}
+
+/* row's chars [from, to) in one piece, returns where char 0 would be */
+char *editorRowWindow(erow *row, int from, int to)
+{
+	if (row != E.gaprow) return row->chars;
+
+	/* the gap goes to whichever end of the window is nearer */
+	if (E.gapat > from && E.gapat < to)
+		editorGapMove(E.gapat - from < to - E.gapat ? from : to);
+	return E.gapat <= from ? row->chars + E.gaplen : row->chars;
+}
+
+/* The render column of char cx, carrying on from char j at column rx. */
+int editorRowCxToRxFrom(erow *row, int j, int rx, int cx)
+{
+	if (row->tabs == 0) return cx;
+	for (; j < cx; j++, rx++)
+		if (*editorRowAt(row, j) == '\t')
+			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+	return rx;
+}
+
+int editorRowCxToRx(erow *row, int cx)
+
+{
+	int rx = 0;
+	int j = 0;
+	if (row->tabs == 0) return cx;
+
+	/* long rows carry on from the last lookup, usually right next to cx */
+	int islong = row->size >= KILO_LONG_LINE;
+	if (islong) editorRxMarkFind(row, cx, 0, &j, &rx);
+	rx = editorRowCxToRxFrom(row, j, rx, cx);
+	if (islong) {
+		E.rxmark[0].row = row;
+		E.rxmark[0].cx = cx;
+		E.rxmark[0].rx = rx;
+	}
+	return rx;
+}
+
+/* The char at render column rx, the one a tab covering rx starts at. */
+int editorRowRxToCx(erow *row, int rx)
+{
+	int cx = 0, cur = 0;
+	if (row->tabs == 0) return rx < row->size ? rx : row->size;
+
+	if (row->size >= KILO_LONG_LINE) editorRxMarkFind(row, -1, rx, &cx, &cur);
+	for (; cx < row->size; cx++) {
+		cur += *editorRowAt(row, cx) == '\t' ? KILO_TAB_STOP - cur % KILO_TAB_STOP : 1;
+		if (cur > rx) return cx;
+	}
+	return cx;
+}
+
+/* whether row is in E.row and counted by the wrap index */
+int editorRowWrapped(erow *row)
+{
+	return row >= E.row && row < E.row + E.wrapvalid;
+}
+
+void editorUpdateRow(erow *row)
+{
+	int j;
+
+	int wrapped = editorRowWrapped(row);
+	int vlines = wrapped ? editorRowVlines(row) : 0;
+	editorRxMarkDrop(row, -1);
+	if (row == E.gaprow) editorGapClose();
+
+	/* count the tabs and the width they expand to, walked here rather than
+	 * by editorRowCxToRx, which would move the marks from the replace
+	 * threads */
+	int tabs = 0, rx = 0;
+	for (j = 0; j < row->size; j++, rx++) {
+		if (row->chars[j] == '\t') {
+			tabs++;
+			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+		}
+	}
+	row->tabs = tabs;
+	row->rsize = rx;
+	row->dirty = 1;
+
+	if (wrapped) editorWrapAdd(row - E.row, editorRowVlines(row) - vlines);
+}
+
+int editorRowIsLong(erow *row)
+{
+	return row->size >= KILO_LONG_LINE;
+}
+
+/* Called instead of editorUpdateRow after a single character edit of a long
+ * row, so the edit doesn't rescan the whole row. c was inserted at or
+ * deleted from at, which was render column rx before the edit, and the gap
+ * is right after it. Columns only change up to the first tab after the
+ * edit. That tab ends on a tab stop, so from there on everything moves by
+ * whole stops and rsize changes by as much as the end of that tab moved.
+ * The gap keeps where that tab is, so it is only looked for once. */
+void editorUpdateLongRow(erow *row, int rx, int c, int inserted)
+{
+	int wrapped = editorRowWrapped(row);
+	int vlines = wrapped ? editorRowVlines(row) : 0;
+	editorRxMarkDrop(row, E.gapat - inserted);
+
+	row->tabs += c == '\t' ? (inserted ? 1 : -1) : 0;
+	row->dirty = 1;
+
+	if (row->tabs == 0) {
+		row->rsize = row->size;
+	} else {
+		int after = row->tabs != E.gaptabs;
+		if (after && E.gapnext == -1) {
+			char *from = &row->chars[E.gapat + E.gaplen];
+			E.gapnext = (char *) memchr(from, '\t', row->size - E.gapat) - from;
+		}
+
+		/* the end of the common part, with and without c in front of it */
+		int plain = after ? E.gapnext : 0;
+		int with = rx + (c == '\t' ? KILO_TAB_STOP - rx % KILO_TAB_STOP : 1) + plain;
+		int without = rx + plain;
+		if (after) {
+			with += KILO_TAB_STOP - with % KILO_TAB_STOP;
+			without += KILO_TAB_STOP - without % KILO_TAB_STOP;
+		}
+		row->rsize += inserted ? with - without : without - with;
+	}
+
+	if (wrapped) editorWrapAdd(row - E.row, editorRowVlines(row) - vlines);
+}
+
+/* Returns len render chars of row starting at render column off. Rows
+ * without tabs or a gap are drawn straight from chars, otherwise the slice
+ * is put together in buf which must hold len bytes. */
+char *editorRowRender(erow *row, int off, int len, char *buf)
+{
+	if (row->tabs == 0) {
+		if (row != E.gaprow) return &row->chars[off];
+
+		/* finding matches to highlight may move the gap, so copy */
+		int n = E.gapat - off;
+		if (n < 0) n = 0;
+		if (n > len) n = len;
+		memcpy(buf, &row->chars[off], n);
+		memcpy(buf + n, editorRowAt(row, off + n), len - n);
+		return buf;
+	}
+
+	/* long rows start from the nearest known column instead of column 0 */
+	int j = 0, rx = 0, n = 0;
+	int islong = editorRowIsLong(row);
+	if (islong) editorRxMarkFind(row, -1, off, &j, &rx);
+	for (; j < row->size && rx < off + len; j++) {
+		int w = 1;
+		char ch = *editorRowAt(row, j);
+		if (ch == '\t') w = KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+		if (islong && rx <= off) {
+			E.rxmark[1].row = row;
+			E.rxmark[1].cx = j;
+			E.rxmark[1].rx = rx;
+		}
+		for (; w > 0; w--, rx++) {
+			if (rx >= off && rx < off + len)
+				buf[n++] = ch == '\t' ? ' ' : ch;
+		}
+	}
+	return buf;
+}
+
+void editorFreeRow(erow *row)
+{
+	if (row == E.gaprow) E.gaprow = NULL;
+	if (!row->inarena && !row->shared) free(row->chars);
+}
+
+/* Make room for size chars plus the terminator. Rows still in the arena are
+ * moved to their own allocation first. The width must be updated after. */
+void editorRowReserve(erow *row, int size)
+{
+	if (row == E.gaprow) editorGapClose();
+	if (row->inarena || row->shared) {
+		char *chars = malloc(size + 1);
+		memcpy(chars, row->chars, row->size + 1);
+		row->chars = chars;
+		row->inarena = 0;
+		row->shared = 0;
+	} else if ((size_t) size + 1 > malloc_usable_size(row->chars)) {
+		/* long rows grow ahead, so typing into one doesn't realloc it every time */
+		size_t cap = size + 1;
+		if (size >= KILO_LONG_LINE) cap += cap / 8;
+		row->chars = realloc(row->chars, cap);
+	}
+	if (row->chars == NULL) die("realloc");
+}
+
+/* Give row the gap and move it to start before char at. The gap takes up
+ * the room the row has spare and grows by an eighth of the row when full. */
+void editorGapOpen(erow *row, int at)
+{
+	if (row != E.gaprow) {
+		editorGapClose();
+		editorRowReserve(row, row->size);
+		E.gaprow = row;
+		E.gapat = row->size;
+		E.gaplen = malloc_usable_size(row->chars) - row->size - 1;
+		E.gaptabs = row->tabs;
+		E.gapnext = -1;
+	}
+	if (E.gaplen == 0) {
+		int grow = row->size / 8 + 1;
+		row->chars = realloc(row->chars, row->size + grow + 1);
+		if (row->chars == NULL) die("realloc");
+		memmove(&row->chars[E.gapat + grow], &row->chars[E.gapat],
+				row->size - E.gapat + 1);
+		E.gaplen = grow;
+	}
+	editorGapMove(at);
+}
+
+/* Replace ndel rows at `at` with the nins rows in ins, taking over their
+ * memory. The removed rows are moved into removed when it is not NULL and
+ * freed otherwise. E.row is reallocated and its tail moved only once. */
+void editorSpliceRows(int at, int ndel, erow *ins, int nins, erow *removed)
+{
+	if (at < 0 || at > E.numrows) return;
+	if (ndel > E.numrows - at) ndel = E.numrows - at;
+	LOG_DEBUG("Splicing %d rows over %d rows at %d.", nins, ndel, at);
+	editorGapClose();
+
+	int j;
+	if (removed) {
+		memcpy(removed, &E.row[at], sizeof(erow) * ndel);
+	} else {
+		for (j = 0; j < ndel; j++) editorFreeRow(&E.row[at + j]);
+	}
+
+	if (nins > ndel) {
+		E.row = realloc(E.row, sizeof(erow) * (E.numrows + nins - ndel));
+		if (E.row == NULL) die("realloc");
+	}
+	memmove(&E.row[at + nins], &E.row[at + ndel],
+			sizeof(erow) * (E.numrows - at - ndel));
+	if (nins) memcpy(&E.row[at], ins, sizeof(erow) * nins);
+	E.numrows += nins - ndel;
+	editorWrapCut(at);
+	editorRxMarkDrop(NULL, -1);
+	E.dirty++;
+}
+
+void editorInsertRows(int at, erow *rows, int n)
+{
+	editorSpliceRows(at, 0, rows, n, NULL);
+}
+
+void editorDelRows(int at, int n)
+{
+	editorSpliceRows(at, n, NULL, 0, NULL);
+}
+
+/* fill in a new row holding a copy of s, not yet part of E.row */
+void editorNewRow(erow *row, char *s, size_t len)
+{
+	row->size = len;
+	row->chars = malloc(len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+
+	row->rsize = 0;
+	row->tabs = 0;
+	row->off = -1;
+	row->inarena = 0;
+	row->shared = 0;
+	editorUpdateRow(row);
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+	if (at < 0 || at > E.numrows) return;
+
+	erow row;
+	editorNewRow(&row, s, len);
+	editorInsertRows(at, &row, 1);
+}
+
+void editorDelRow(int at)
+{
+	if (at < 0 || at >= E.numrows) return;
+	LOG_DEBUG("Deleting row %d.", at);
+	editorDelRows(at, 1);
+}
+
+/* copy a row including its width, so it doesn't have to be rescanned */
+void editorDupRow(erow *dst, erow *src)
+{
+	dst->size = src->size;
+	dst->chars = malloc(src->size + 1);
+	memcpy(dst->chars, src->chars, src->size + 1);
+	dst->rsize = src->rsize;
+	dst->tabs = src->tabs;
+	dst->dirty = 1;
+	dst->off = -1;
+	dst->inarena = 0;
+	dst->shared = 0;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+	editorRowReserve(row, row->size + len);
+	LOG_DEBUG("Appending \"%.*s\" to \"%s\"", (int) len, s, row->chars);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
+{
+	LOG_DEBUG("Inserting Character %c at position %d in row %d.", c, at, E.cy);
+	if (at < 0 || at > row->size) at = row->size;
+	if (editorRowIsLong(row)) {
+		int rx = editorRowCxToRx(row, at);
+		editorGapOpen(row, at);
+		row->chars[E.gapat++] = c;
+		E.gaplen--;
+		if (c == '\t') E.gaptabs++;
+		row->size++;
+		editorUpdateLongRow(row, rx, c, 1);
+	} else {
+		editorRowReserve(row, row->size + 1);
+		memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+		row->size++;
+		row->chars[at] = c;
+		editorUpdateRow(row);
+	}
+	E.dirty++;
+}
+
+void editorRowDeleteChar(erow *row, int at)
+{
+	if (at < 0 || at >= row->size) return;
+	int c = *editorRowAt(row, at);
+	LOG_DEBUG("Deleting Character %c at position %d in row %d.", c, at, E.cy);
+	if (editorRowIsLong(row)) {
+		int rx = editorRowCxToRx(row, at);
+		editorGapOpen(row, at + 1);
+		E.gapat--;
+		E.gaplen++;
+		if (c == '\t') E.gaptabs--;
+		row->size--;
+		editorUpdateLongRow(row, rx, c, 0);
+	} else {
+		if (row->shared || row == E.gaprow) editorRowReserve(row, row->size);
+		memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+		row->size--;
+		editorUpdateRow(row);
+	}
+	E.dirty++;
+}
+
+
+/*** editor operations ***/
+
+void editorInsertChar(int c)
+{
+	if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+	editorRowInsertChar(&E.row[E.cy], E.cx, c);
+	E.cx++;
+}
+
+void editorInsertNewline() {
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		editorGapClose();
+		erow *row = &E.row[E.cy];
+		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+		row = &E.row[E.cy];
+		if (row->shared) editorRowReserve(row, row->size);
+		row->size = E.cx;
+		row->chars[row->size] = '\0';
+		editorUpdateRow(row);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void editorDeleteChar()
+{
+	if (E.cy == E.numrows) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+	erow *row = &E.row[E.cy];
+	if (E.cx > 0) {
+		editorRowDeleteChar(row, E.cx - 1);
+		E.cx--;
+	} else if (E.cx == 0) {
+		E.cx = E.row[E.cy - 1].size;
+		LOG_DEBUG("Appending row %d string to row %d end.", E.cy, E.cy - 1);
+		editorGapClose();
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	} else {
+		LOG_ERROR("E.cx < 0: E.cx = %d", E.cx);
+	}
+}
+
+/*** selection ***/
+
+/* The selection runs from the mark to the cursor row, or is just the cursor
+ * row when nothing is marked. Returns the number of selected rows. */
+int editorSelection(int *start)
+{
+	if (E.numrows == 0) return 0;
+
+	int last = E.cy < E.numrows ? E.cy : E.numrows - 1;
+	int first = last;
+	if (E.mark != -1) {
+		first = E.mark < E.numrows ? E.mark : E.numrows - 1;
+		if (first > last) {
+			int tmp = first;
+			first = last;
+			last = tmp;
+		}
+	}
+	*start = first;
+	return last - first + 1;
+}
+
+void editorToggleMark()
+{
+	if (E.mark != -1) {
+		E.mark = -1;
+		editorSetStatusMessage("Mark cleared");
+	} else {
+		E.mark = E.cy;
+		editorSetStatusMessage("Mark set");
+	}
+}
+
+int editorCmpPtr(const void *a, const void *b)
+{
+	char *pa = *(char * const *) a, *pb = *(char * const *) b;
+	return pa < pb ? -1 : pa > pb;
+}
+
+/* Rows a paste moved out of the yank still share their chars with it. Before
+ * the yank goes, those rows, wherever they are now, take the chars over. */
+void editorYankRelease()
+{
+	/* every shared chars came from a different yanked row */
+	char **keep = malloc(sizeof(char *) * (E.yanklen + 1));
+	int nkeep = 0, i, j;
+
+	for (i = 0; i < E.numbufs; i++) {
+		erow *rows = i == E.curbuf ? E.row : E.buf[i].row;
+		int n = i == E.curbuf ? E.numrows : E.buf[i].numrows;
+		for (j = 0; j < n; j++) {
+			if (!rows[j].shared) continue;
+			rows[j].shared = 0;
+			keep[nkeep++] = rows[j].chars;
+		}
+	}
+
+	/* so may the undo record of a replace */
+	for (j = 0; j < E.undolen; j++) {
+		if (!E.undo[j].shared) continue;
+		E.undo[j].shared = 0;
+		keep[nkeep++] = E.undo[j].chars;
+	}
+
+	qsort(keep, nkeep, sizeof(char *), editorCmpPtr);
+	for (j = 0; j < E.yanklen; j++) {
+		if (bsearch(&E.yank[j].chars, keep, nkeep, sizeof(char *), editorCmpPtr))
+			E.yank[j].chars = NULL;
+	}
+	LOG_DEBUG("Handed %d shared rows over from the yank.", nkeep);
+	free(keep);
+	E.yanklent = 0;
+}
+
+void editorFreeYank()
+{
+	int j;
+	if (E.yanklent) editorYankRelease();
+	for (j = 0; j < E.yanklen; j++) editorFreeRow(&E.yank[j]);
+	free(E.yank);
+	E.yank = NULL;
+	E.yanklen = 0;
+	E.yankcut = 0;
+}
+
+/* cut moves the rows themselves into the yank buffer, nothing is copied */
+void editorCutRows()
+{
+	int at, n = editorSelection(&at);
+	if (n == 0) return;
+
+	editorFreeYank();
+	E.yank = malloc(sizeof(erow) * n);
+	editorSpliceRows(at, n, NULL, 0, E.yank);
+	E.yanklen = n;
+	E.yankcut = 1;
+	E.yankbuf = E.curbuf;
+
+	E.mark = -1;
+	E.cy = at;
+	E.cx = 0;
+	editorSetStatusMessage("Cut %d lines", n);
+}
+
+void editorCopyRows()
+{
+	int at, n = editorSelection(&at);
+	if (n == 0) return;
+
+	editorFreeYank();
+	E.yank = malloc(sizeof(erow) * n);
+	int j;
+	for (j = 0; j < n; j++) editorDupRow(&E.yank[j], &E.row[at + j]);
+	E.yanklen = n;
+
+	E.mark = -1;
+	editorSetStatusMessage("Copied %d lines", n);
+}
+
+/* Paste the yanked rows above the cursor row. The first paste after a cut
+ * puts the cut rows themselves back. Their chars stay shared with the yank,
+ * so later pastes can still copy them, and an edit copies a shared row
+ * before changing it. Rows cut from another buffer may point into its
+ * arena, those are always copied. */
+void editorPasteRows()
+{
+	if (E.yanklen == 0) return;
+
+	erow *rows = malloc(sizeof(erow) * E.yanklen);
+	int j;
+	if (E.yankcut && E.yankbuf == E.curbuf) {
+		memcpy(rows, E.yank, sizeof(erow) * E.yanklen);
+		/* rows still in the arena are shared as well, the yank points at
+		 * the same arena bytes and an edit in place would change both */
+		for (j = 0; j < E.yanklen; j++) rows[j].shared = 1;
+		E.yankcut = 0;
+		E.yanklent = 1;
+	} else {
+		for (j = 0; j < E.yanklen; j++) editorNewRow(&rows[j], E.yank[j].chars, E.yank[j].size);
+	}
+	editorInsertRows(E.cy, rows, E.yanklen);
+	free(rows);
+
+	E.cx = 0;
+	editorSetStatusMessage("Pasted %d lines", E.yanklen);
+}
+
+/*** file i/o ***/
+
+/* Remember st as the file the rows were read from or written to. */
+void editorFileRemember(struct stat *st)
+{
+	E.followino = st ? st->st_ino : 0;
+	E.followoff = st ? st->st_size : 0;
+	E.followmtime.tv_sec = st ? st->st_mtim.tv_sec : 0;
+	E.followmtime.tv_nsec = st ? st->st_mtim.tv_nsec : 0;
+}
+
+/* Returns 1 if st is still the file the rows' offsets were taken from, so
+ * writing over those offsets can't mix two files. */
+int editorFileUnchanged(struct stat *st)
+{
+	return st->st_ino == E.followino && st->st_size == E.followoff &&
+		   st->st_mtim.tv_sec == E.followmtime.tv_sec &&
+		   st->st_mtim.tv_nsec == E.followmtime.tv_nsec;
+}
+
+/* path with symlinks, "." and ".." resolved, so two spellings of one file
+ * compare equal. A file that doesn't exist yet is resolved through its
+ * directory. Returns a copy of path if that fails too. */
+char *editorRealPath(const char *path)
+{
+	char *real = realpath(path, NULL);
+	if (real) return real;
+
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+	char *realdir = realpath(dir, NULL);
+	free(dir);
+	if (realdir == NULL) return strdup(path);
+
+	const char *base = slash ? slash + 1 : path;
+	size_t len = strlen(realdir) + strlen(base) + 2;
+	real = malloc(len);
+	snprintf(real, len, "%s/%s", strcmp(realdir, "/") ? realdir : "", base);
+	free(realdir);
+	return real;
+}
+
+/* Let go of the current buffer's arena. Yanked rows may still point into it,
+ * those get their own copy first. */
+void editorFreeArena()
+{
+	int j;
+	for (j = 0; j < E.yanklen; j++) {
+		erow *row = &E.yank[j];
+		if (row->inarena && row->chars >= E.arena && row->chars < E.arena + E.arenalen)
+			editorRowReserve(row, row->size);
+	}
+	free(E.arena);
+	E.arena = NULL;
+	E.arenalen = 0;
+}
+
+/* The whole file is read into one arena and every row's chars point into it,
+ * terminated in place. That saves a malloc and a copy per row, a row only
+ * gets its own allocation once an edit has to grow it. Returns -1 if the file
+ * can't be read. The buffer is then left empty, but keeps the filename, so a
+ * file that doesn't exist yet is created on save. */
+int editorOpen(char *filename)
+{
+	/* lazily loaded buffers open their own E.filename */
+	if (filename != E.filename) {
+		free(E.filename);
+		E.filename = strdup(filename);
+	}
+	int fd = open(filename, O_RDONLY);
+	LOG_INFO("Opening %s for reading", filename);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		int err = errno;
+		LOG_WARN("Can't open %s: %s", filename, strerror(err));
+		if (err == ENOENT) editorSetStatusMessage("New file: %.60s", filename);
+		else editorSetStatusMessage("Can't open %.40s: %s", filename, strerror(err));
+		if (fd != -1) close(fd);
+		editorFileRemember(NULL);
+		E.followpartial = 0;
+		E.dirty = 0;
+		return -1;
+	}
+
+	/* remember what was read, so follow mode can carry on from there */
+	editorFileRemember(&st);
+	E.followpartial = 0;
+
+	/* st_size is only a hint, /proc files claim 0 bytes and pipes anything,
+	 * so read until EOF. A full arena is only grown once a read past its end
+	 * turns up more. */
+	editorFreeArena();
+	size_t cap = st.st_size + 1, len = 0;
+	E.arena = malloc(cap);
+	if (E.arena == NULL) die("malloc");
+	for (;;) {
+		char more[4096];
+		int full = len + 1 == cap;
+		ssize_t n = read(fd, full ? more : E.arena + len,
+						 full ? sizeof(more) : cap - 1 - len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) LOG_WARN("Reading %s failed: %s", filename, strerror(errno));
+		if (n <= 0) break;
+		if (full) {
+			cap = cap * 2 + n;
+			E.arena = realloc(E.arena, cap);
+			if (E.arena == NULL) die("realloc");
+			memcpy(E.arena + len, more, n);
+		}
+		len += n;
+	}
+	E.arenalen = len + 1;
+	LOG_INFO("Closing %s after reading %zu bytes from it", filename, len);
+	close(fd);
+
+	char *p = E.arena, *end = E.arena + len, *nl;
+	erow *rows = NULL;
+	int nrows = 0, rowcap = 0;
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		int linelen = (nl ? nl : end) - p;
+		while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+		p[linelen] = '\0';
+
+		if (nrows == rowcap) {
+			rowcap = rowcap ? rowcap * 2 : 1024;
+			rows = realloc(rows, sizeof(erow) * rowcap);
+			if (rows == NULL) die("realloc");
+		}
+		erow *row = &rows[nrows++];
+		row->chars = p;
+		row->size = linelen;
+		row->off = p - E.arena;
+		row->inarena = 1;
+		row->shared = 0;
+		editorUpdateRow(row);
+		row->dirty = 0;
+
+		E.followpartial = (nl == NULL);
+		p = nl ? nl + 1 : end;
+	}
+	E.followoff = len;
+	editorInsertRows(E.numrows, rows, nrows);
+	free(rows);
+	E.dirty = 0;
+	return 0;
+}
+
+/* Write rows [from, to), each followed by a newline, at offset off. The rows
+ * are handed to pwritev as they are, without building a copy. */
+int editorWriteRows(int fd, int from, int to, off_t off)
+{
+	struct iovec iov[KILO_IOV_ROWS * 2];
+
+	while (from < to) {
+		int n = 0;
+		ssize_t want = 0;
+		for (; from < to && n < KILO_IOV_ROWS * 2; from++) {
+			iov[n].iov_base = E.row[from].chars;
+			iov[n++].iov_len = E.row[from].size;
+			iov[n].iov_base = (char *) "\n";
+			iov[n++].iov_len = 1;
+			want += E.row[from].size + 1;
+		}
+
+		/* pwritev may write less than asked, carry on from where it stopped */
+		struct iovec *v = iov;
+		while (want > 0) {
+			ssize_t w = pwritev(fd, v, n, off);
+			if (w == -1 && errno == EINTR) continue;
+			if (w <= 0) return -1;
+			off += w;
+			want -= w;
+			while (n > 0 && (size_t) w >= v->iov_len) {
+				w -= v->iov_len;
+				v++;
+				n--;
+			}
+			if (n > 0) {
+				v->iov_base = (char *) v->iov_base + w;
+				v->iov_len -= w;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Write every row into a temporary file and rename it over the original,
+ * st being the original's stat or NULL for a new file. Fails rather than
+ * give the file another owner. */
+int editorSaveAtomic(struct stat *st)
+{
+	mode_t mode = st ? st->st_mode & 07777 : 0644;
+	size_t len = strlen(E.filename) + 8;
+	char *tmp = malloc(len);
+	snprintf(tmp, len, "%s.kilo~", E.filename);
+
+	LOG_INFO("Rewriting %s through %s.", E.filename, tmp);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd == -1) {
+		free(tmp);
+		return -1;
+	}
+	if ((st && fchown(fd, st->st_uid, st->st_gid) == -1) ||
+		editorWriteRows(fd, 0, E.numrows, 0) == -1 || fsync(fd) == -1) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	close(fd);
+
+	int ret = rename(tmp, E.filename);
+	if (ret == -1) unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+/* Rewrite the file from row first, at offset start, and cut it at len. */
+int editorSaveTail(int first, off_t start, off_t len)
+{
+	int fd = open(E.filename, O_WRONLY);
+	if (fd == -1) return -1;
+	int ret = editorWriteRows(fd, first, E.numrows, start);
+	if (ret == 0) ret = ftruncate(fd, len);
+	close(fd);
+	return ret;
+}
+
+/* Write the dirty rows in place, when none of the rows moved in the file. */
+int editorSaveInPlace(int fd, off_t *written)
+{
+	int j = 0, k;
+	while (j < E.numrows) {
+		if (!E.row[j].dirty) {
+			j++;
+			continue;
+		}
+		for (k = j; k < E.numrows && E.row[k].dirty; k++) *written += E.row[k].size + 1;
+		if (editorWriteRows(fd, j, k, E.row[j].off) == -1) return -1;
+		j = k;
+	}
+	return 0;
+}
+
+/* Saving picks the cheapest way to bring the file up to date. When no row
+ * moved, only the dirty rows are written over their old bytes. When the
+ * changes start late in the file, only the tail from the first changed row
+ * is rewritten and the file truncated. Anything else is a full rewrite into
+ * a temporary file renamed over the original, or over the original itself
+ * when a rename would replace a symlink, split hard links, change the
+ * owner or isn't allowed in the directory. */
+void editorSave()
+{
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename != NULL && E.filename[0] == '\0') {
+			free(E.filename);
+			E.filename = NULL;
+		}
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save Aborted");
+			return;
+		}
+	}
+
+	struct stat st;
+	int exists = stat(E.filename, &st) == 0;
+	if (!exists) st.st_size = 0;
+
+	/* the rows' offsets only say where they are in the file they came from,
+	 * a file replaced or changed behind our back gets a full rewrite */
+	int same = exists && editorFileUnchanged(&st);
+
+	/* lay the rows out and find the first one that changed or moved */
+	off_t len = 0, start = -1;
+	int first = E.numrows, moved = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		if (row->off != len) moved = 1;
+		if (first == E.numrows && (row->dirty || row->off != len ||
+								   len + row->size + 1 > st.st_size)) {
+			first = j;
+			start = len;
+		}
+		len += row->size + 1;
+	}
+	if (first == E.numrows) start = len;
+
+	off_t written = 0;
+	int ret = -1;
+	if (same && !moved && len == st.st_size) {
+		LOG_INFO("Writing the dirty rows of %s in place.", E.filename);
+		int fd = open(E.filename, O_WRONLY);
+		if (fd != -1) {
+			ret = editorSaveInPlace(fd, &written);
+			close(fd);
+		}
+	} else if (same && (len - start) * 2 <= len) {
+		LOG_INFO("Rewriting %s from row %d, offset %lld.", E.filename, first,
+				 (long long) start);
+		ret = editorSaveTail(first, start, len);
+		written = len - start;
+	} else {
+		struct stat lst;
+		if (!exists || (lstat(E.filename, &lst) == 0 && !S_ISLNK(lst.st_mode) &&
+						st.st_nlink == 1))
+			ret = editorSaveAtomic(exists ? &st : NULL);
+		if (ret == -1 && exists) {
+			LOG_INFO("Rewriting all of %s in place.", E.filename);
+			ret = editorSaveTail(0, 0, len);
+		}
+		written = len;
+	}
+
+	if (ret == -1) {
+		LOG_ERROR("Saving %s failed: %s", E.filename, strerror(errno));
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		return;
+	}
+
+	/* the file now matches the rows */
+	len = 0;
+	for (j = 0; j < E.numrows; j++) {
+		E.row[j].off = len;
+		E.row[j].dirty = 0;
+		len += E.row[j].size + 1;
+	}
+	LOG_INFO("%lld of %lld bytes written to %s successfully.", (long long) written,
+			 (long long) len, E.filename);
+	editorSetStatusMessage("%lld bytes written to disk in %s", (long long) written, E.filename);
+	E.dirty = 0;
+	editorFreeUndo(); /* E.dirty starts over, the undo check can't tell anymore */
+	E.followpartial = 0;
+	ino_t ino = E.followino;
+	if (stat(E.filename, &st) == 0) {
+		editorFileRemember(&st);
+
+		/* a rename leaves the watch on the old file */
+		if (E.follow && st.st_ino != ino) editorFollowWatch();
+	} else {
+		editorFileRemember(NULL);
+	}
+}
+
+/* Read the file again if it changed on disk since it was read or saved,
+ * unless that would lose edits, then only warn. Buffers stay resident, so
+ * this is done whenever one is shown again. */
+void editorFileCheck()
+{
+	struct stat st;
+	if (E.filename == NULL || stat(E.filename, &st) == -1) return;
+	if (!S_ISREG(st.st_mode) || editorFileUnchanged(&st)) return;
+
+	if (E.dirty) {
+		editorSetStatusMessage("%.40s changed on disk, saving will overwrite it",
+							   E.filename);
+		return;
+	}
+	LOG_INFO("%s changed on disk, reloading.", E.filename);
+	editorFreeUndo();
+	editorDelRows(0, E.numrows);
+	if (editorOpen(E.filename) == -1) return;
+	if (E.cy > E.numrows) E.cy = E.numrows;
+	if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+	editorSetStatusMessage("%.40s changed on disk, reloaded", E.filename);
+}
+
+/*** follow mode ***/
+
+/* (Re)point the inotify watch at the current buffer's file. */
+void editorFollowWatch()
+{
+	if (E.ifd == -1) {
+		E.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (E.ifd == -1) {
+			LOG_WARN("inotify_init1 failed: %s", strerror(errno));
+			return;
+		}
+	}
+	if (E.iwd != -1) inotify_rm_watch(E.ifd, E.iwd);
+	if (E.idwd != -1) inotify_rm_watch(E.ifd, E.idwd);
+	E.iwd = E.idwd = -1;
+
+	if (!E.follow || E.filename == NULL) return;
+	E.iwd = inotify_add_watch(E.ifd, E.filename,
+							  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	if (E.iwd == -1) LOG_WARN("Can't watch %s: %s", E.filename, strerror(errno));
+
+	/* after a rotation the file may only be created later, the watch above
+	 * stays with the old one, so look out for the name in the directory */
+	char dir[PATH_MAX];
+	char *slash = strrchr(E.filename, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else {
+		int len = slash == E.filename ? 1 : slash - E.filename;
+		if (len >= PATH_MAX) return;
+		memcpy(dir, E.filename, len);
+		dir[len] = '\0';
+	}
+	E.idwd = inotify_add_watch(E.ifd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+	if (E.idwd == -1) LOG_WARN("Can't watch %s: %s", dir, strerror(errno));
+}
+
+/* Append the bytes after E.followoff as rows. The last row is completed
+ * first if the file previously ended without a newline. */
+void editorFollowAppend(struct stat *st)
+{
+	int fd = open(E.filename, O_RDONLY);
+	if (fd == -1) return;
+
+	size_t len = st->st_size - E.followoff;
+	char *buf = malloc(len);
+	ssize_t n = pread(fd, buf, len, E.followoff);
+	close(fd);
+	if (n <= 0) {
+		free(buf);
+		return;
+	}
+	LOG_INFO("Following %s: %zd new bytes at offset %lld", E.filename, n,
+			 (long long) E.followoff);
+	E.followoff += n;
+	if (E.followoff == st->st_size) E.followmtime = st->st_mtim;
+
+	char *p = buf, *end = buf + n, *nl;
+	erow *rows = NULL;
+	int nrows = 0, rowcap = 0;
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		int linelen = eol - p;
+		if (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+
+		/* rows read from the file are already saved as they are, and
+		 * editorFollowCheck made sure the partial row is one of them */
+		if (E.followpartial && E.numrows > 0) {
+			editorRowAppendString(&E.row[E.numrows - 1], p, linelen);
+			E.row[E.numrows - 1].dirty = 0;
+		} else {
+			if (nrows == rowcap) {
+				rowcap = rowcap ? rowcap * 2 : 64;
+				rows = realloc(rows, sizeof(erow) * rowcap);
+			}
+			editorNewRow(&rows[nrows], p, linelen);
+			rows[nrows].off = E.followoff - n + (p - buf);
+			rows[nrows++].dirty = 0;
+		}
+		E.followpartial = (nl == NULL);
+		p = nl ? nl + 1 : end;
+	}
+	editorInsertRows(E.numrows, rows, nrows);
+	free(rows);
+	free(buf);
+}
+
+/* Bring the buffer up to date with its file. Returns 1 if rows changed. */
+int editorFollowCheck()
+{
+	struct stat st;
+	if (E.filename == NULL || stat(E.filename, &st) == -1) return 0;
+	if (st.st_ino == E.followino && st.st_size == E.followoff) return 0;
+
+	int reload = st.st_ino != E.followino || st.st_size < E.followoff;
+
+	/* an unterminated last line is only completed in place while it is
+	 * still the row read from the file, not one the user edited or replaced */
+	if (!reload && E.followpartial) {
+		erow *last = E.numrows > 0 ? &E.row[E.numrows - 1] : NULL;
+		off_t rest = last ? E.followoff - last->off - last->size : -1;
+		if (last == NULL || last->dirty || last->off == -1 || rest < 0 || rest > 1)
+			reload = 1;
+	}
+	if (reload && E.dirty) {
+		/* reloading would throw the edits away, leave that to the user */
+		E.follow = 0;
+		editorFollowWatch();
+		editorSetStatusMessage("%.40s changed on disk, follow off to keep "
+							   "unsaved changes", E.filename);
+		return 1;
+	}
+
+	int atend = E.cy >= E.numrows - 1;
+	int dirty = E.dirty;
+
+	/* rows the undo record points at may be gone, and E.dirty is reset */
+	editorFreeUndo();
+
+	if (reload) {
+
+		/* rotated, truncated or the partial row is gone, the only cases
+		 * where everything is re-read */
+		LOG_INFO("%s was rotated or truncated, reloading.", E.filename);
+		editorDelRows(0, E.numrows);
+		editorOpen(E.filename);
+		editorFollowWatch();
+		dirty = 0;
+		if (E.cy > E.numrows) E.cy = E.numrows;
+	} else {
+		editorFollowAppend(&st);
+	}
+	E.dirty = dirty;
+
+	if (atend) {
+		E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+		E.cx = 0;
+	}
+	return 1;
+}
+
+/* Drain pending inotify events. Returns 1 if the screen needs a refresh. */
+int editorFollowPoll()
+{
+	if (E.ifd == -1) return 0;
+
+	char events[4096];
+	int pending = 0;
+	while (read(E.ifd, events, sizeof(events)) > 0) pending = 1;
+	if (!pending || !E.follow) return 0;
+
+	return editorFollowCheck();
+}
+
+void editorToggleFollow()
+{
+	if (E.filename == NULL) {
+		editorSetStatusMessage("Follow needs a file");
+		return;
+	}
+	E.follow = !E.follow;
+	editorFollowWatch();
+	if (E.follow) {
+		editorFollowCheck();
+		E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+		E.cx = 0;
+	}
+	editorSetStatusMessage("Follow %s", E.follow ? "on" : "off");
+}
+
+/*** replace ***/
+
+struct replaceJob {
+	pthread_t thread;
+	int start, end; /* rows [start, end) */
+	const char *query;
+	size_t qlen;
+	const char *with;
+	size_t wlen;
+	editorUndoRow *undo;
+	int undolen;
+	int count;
+};
+
+void editorFreeUndo()
+{
+	int j;
+	for (j = 0; j < E.undolen; j++) {
+		if (!E.undo[j].inarena && !E.undo[j].shared) free(E.undo[j].chars);
+	}
+	free(E.undo);
+	E.undo = NULL;
+	E.undolen = 0;
+}
+
+/* Rewrite every row in the job's range that contains the query. Each row is
+ * allocated once at its final size and rendered once, the old chars are
+ * handed over to the undo record instead of being freed. */
+void *editorReplaceWorker(void *arg)
+{
+	struct replaceJob *job = arg;
+	int undocap = 0;
+	int j;
+
+	for (j = job->start; j < job->end; j++) {
+		erow *row = &E.row[j];
+		char *end = row->chars + row->size;
+		char *p = row->chars;
+		int n = 0;
+
+		while ((p = memmem(p, end - p, job->query, job->qlen)) != NULL) {
+			p += job->qlen;
+			n++;
+		}
+		if (n == 0) continue;
+
+		int size = row->size + n * ((int) job->wlen - (int) job->qlen);
+		char *chars = malloc(size + 1);
+		char *dst = chars;
+		char *src = row->chars;
+		while ((p = memmem(src, end - src, job->query, job->qlen)) != NULL) {
+			memcpy(dst, src, p - src);
+			dst += p - src;
+			memcpy(dst, job->with, job->wlen);
+			dst += job->wlen;
+			src = p + job->qlen;
+		}
+		memcpy(dst, src, end - src);
+		chars[size] = '\0';
+
+		if (job->undolen == undocap) {
+			undocap = undocap ? undocap * 2 : 16;
+			job->undo = realloc(job->undo, sizeof(editorUndoRow) * undocap);
+		}
+		job->undo[job->undolen].at = j;
+		job->undo[job->undolen].size = row->size;
+		job->undo[job->undolen].chars = row->chars;
+		job->undo[job->undolen].inarena = row->inarena;
+		job->undo[job->undolen].shared = row->shared;
+		job->undolen++;
+
+		row->chars = chars;
+		row->inarena = 0;
+		row->shared = 0;
+		row->size = size;
+		editorUpdateRow(row);
+		job->count += n;
+	}
+	return NULL;
+}
+
+void editorReplace()
+{
+	char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+	if (query == NULL) return;
+	if (query[0] == '\0') {
+		free(query);
+		return;
+	}
+	char *with = editorPrompt("With: %s (ESC to cancel)", NULL);
+	if (with == NULL) {
+		free(query);
+		return;
+	}
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > KILO_REPLACE_MAX_THREADS) nthreads = KILO_REPLACE_MAX_THREADS;
+	if (nthreads > E.numrows / KILO_REPLACE_MIN_ROWS) nthreads = E.numrows / KILO_REPLACE_MIN_ROWS;
+	if (nthreads < 1) nthreads = 1;
+	LOG_INFO("Replacing \"%s\" with \"%s\" using %ld threads", query, with, nthreads);
+
+	struct replaceJob jobs[KILO_REPLACE_MAX_THREADS];
+	int j;
+	for (j = 0; j < nthreads; j++) {
+		jobs[j].start = (long) E.numrows * j / nthreads;
+		jobs[j].end = (long) E.numrows * (j + 1) / nthreads;
+		jobs[j].query = query;
+		jobs[j].qlen = strlen(query);
+		jobs[j].with = with;
+		jobs[j].wlen = strlen(with);
+		jobs[j].undo = NULL;
+		jobs[j].undolen = 0;
+		jobs[j].count = 0;
+	}
+
+	/* the threads can't share the wrap index, rebuild it afterwards, and
+	 * clearing the column marks now leaves the threads nothing to write */
+	E.wrapvalid = 0;
+	editorRxMarkDrop(NULL, -1);
+
+	/* the calling thread takes the first chunk itself, and the chunks no
+	 * thread could be started for */
+	int started = 1;
+	while (started < nthreads && pthread_create(&jobs[started].thread, NULL,
+												editorReplaceWorker, &jobs[started]) == 0)
+		started++;
+	if (started < nthreads) LOG_WARN("Started %d of %ld replace threads.", started, nthreads);
+	for (j = started; j < nthreads; j++) editorReplaceWorker(&jobs[j]);
+	editorReplaceWorker(&jobs[0]);
+	for (j = 1; j < started; j++) pthread_join(jobs[j].thread, NULL);
+
+	/* merge the per thread undo rows, they are already in row order */
+	int count = 0, undolen = 0;
+	for (j = 0; j < nthreads; j++) {
+		count += jobs[j].count;
+		undolen += jobs[j].undolen;
+	}
+
+	if (undolen > 0) {
+		editorFreeUndo();
+		E.undo = malloc(sizeof(editorUndoRow) * undolen);
+		for (j = 0; j < nthreads; j++) {
+			memcpy(&E.undo[E.undolen], jobs[j].undo, sizeof(editorUndoRow) * jobs[j].undolen);
+			E.undolen += jobs[j].undolen;
+		}
+		E.dirty++;
+		E.undodirty = E.dirty;
+		if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+	}
+	for (j = 0; j < nthreads; j++) free(jobs[j].undo);
+
+	editorSetStatusMessage("Replaced %d occurrences in %d lines", count, undolen);
+	free(query);
+	free(with);
+}
+
+void editorUndoReplace()
+{
+	if (E.undolen == 0 || E.undodirty != E.dirty) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+
+	int j;
+	for (j = 0; j < E.undolen; j++) {
+		erow *row = &E.row[E.undo[j].at];
+		free(row->chars);
+		row->chars = E.undo[j].chars;
+		row->inarena = E.undo[j].inarena;
+		row->shared = E.undo[j].shared;
+		row->size = E.undo[j].size;
+		editorUpdateRow(row);
+		E.undo[j].chars = NULL;
+	}
+	editorSetStatusMessage("Undid replace in %d lines", E.undolen);
+	editorFreeUndo();
+	if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+	E.dirty++;
+}
+
+/*** filter ***/
+
+/* Turn the complete lines at the start of buf into rows. Returns how many
+ * bytes were used, a line without its newline yet is left in buf. */
+int editorFilterSplit(char *buf, int len, int eof, erow **rows, int *nrows, int *rowcap)
+{
+	char *p = buf, *end = buf + len, *nl;
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL && !eof) break;
+		char *eol = nl ? nl : end;
+		int linelen = eol - p;
+		if (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+
+		if (*nrows == *rowcap) {
+			*rowcap = *rowcap ? *rowcap * 2 : 64;
+			*rows = realloc(*rows, sizeof(erow) * *rowcap);
+			if (*rows == NULL) die("realloc");
+		}
+		editorNewRow(&(*rows)[(*nrows)++], p, linelen);
+		p = nl ? nl + 1 : end;
+	}
+	return p - buf;
+}
+
+/* Write as much of rows [*wrow, last) to fd as the pipe takes, starting
+ * *woff bytes into *wrow. The rows' chars are written as they are, with
+ * the newlines in between coming from a separate iovec. Returns -1 when
+ * the command stopped reading. */
+int editorFilterWrite(int fd, int *wrow, int *woff, int last)
+{
+	static char nl = '\n';
+	struct iovec iov[KILO_IOV_ROWS * 2];
+	int k = 0, r;
+
+	for (r = *wrow; r < last && k < KILO_IOV_ROWS * 2; r++) {
+		int off = r == *wrow ? *woff : 0;
+		if (off < E.row[r].size) {
+			iov[k].iov_base = E.row[r].chars + off;
+			iov[k++].iov_len = E.row[r].size - off;
+		}
+		iov[k].iov_base = &nl;
+		iov[k++].iov_len = 1;
+	}
+
+	ssize_t w = writev(fd, iov, k);
+	if (w == -1) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+	while (w > 0) {
+		int left = E.row[*wrow].size + 1 - *woff;
+		if (w < left) {
+			*woff += w;
+			break;
+		}
+		w -= left;
+		(*wrow)++;
+		*woff = 0;
+	}
+	return 0;
+}
+
+/* Pipe the selected rows, or the current row, through a shell command and
+ * replace them with its output. The rows are written to the command while
+ * its output is read, so neither side can block the other on a full pipe,
+ * and the output becomes rows as it arrives. The rows are kept as they were
+ * when the command fails or ESC is pressed. */
+void editorFilterRows()
+{
+	int at = 0, n = editorSelection(&at);
+	char *cmd = editorPrompt("Filter: %s (ESC to cancel)", NULL);
+	if (cmd == NULL) return;
+	if (cmd[0] == '\0') {
+		free(cmd);
+		return;
+	}
+
+	/* running out of descriptors or processes only fails the filter */
+	int in[2] = {-1, -1}, out[2] = {-1, -1};
+	pid_t pid = -1;
+	if (pipe2(in, O_CLOEXEC) == 0 && pipe2(out, O_CLOEXEC) == 0) pid = fork();
+	if (pid == -1) {
+		int err = errno, j;
+		for (j = 0; j < 2; j++) {
+			if (in[j] != -1) close(in[j]);
+			if (out[j] != -1) close(out[j]);
+		}
+		LOG_ERROR("Can't start filter \"%s\": %s", cmd, strerror(err));
+		editorSetStatusMessage("Can't run filter: %s", strerror(err));
+		free(cmd);
+		return;
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		if (null != -1) dup2(null, STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	LOG_INFO("Filtering %d rows at %d through \"%s\" (pid %d)", n, at, cmd, (int) pid);
+
+	editorSetStatusMessage("Filtering %d lines... (ESC to cancel)", n);
+	editorRefreshScreen();
+
+	/* a command that exits without reading all input must not kill us */
+	void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+	int bufcap = 65536, buflen = 0;
+	char *buf = malloc(bufcap);
+	erow *rows = NULL;
+	int nrows = 0, rowcap = 0;
+	int wrow = at, woff = 0, cancelled = 0;
+	struct pollfd pfd[3];
+	pfd[0].fd = in[1];
+	pfd[0].events = POLLOUT;
+	pfd[1].fd = out[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = STDIN_FILENO;
+	pfd[2].events = POLLIN;
+
+	while (pfd[1].fd != -1) {
+		if (pfd[0].fd != -1 && wrow == at + n) {
+			close(pfd[0].fd);
+			pfd[0].fd = -1;
+		}
+		if (poll(pfd, 3, -1) == -1) {
+			if (errno == EINTR) continue;
+			LOG_ERROR("poll failed: %s", strerror(errno));
+			kill(pid, SIGKILL);
+			cancelled = 1;
+			if (pfd[0].fd != -1) close(pfd[0].fd);
+			close(pfd[1].fd);
+			pfd[0].fd = pfd[1].fd = -1;
+			break;
+		}
+
+		if (pfd[0].fd != -1 && pfd[0].revents) {
+			if ((pfd[0].revents & POLLOUT) == 0 ||
+				editorFilterWrite(pfd[0].fd, &wrow, &woff, at + n) == -1) {
+				close(pfd[0].fd);
+				pfd[0].fd = -1;
+			}
+		}
+
+		if (pfd[1].revents) {
+			if (buflen == bufcap) {
+				bufcap *= 2;
+				buf = realloc(buf, bufcap);
+				if (buf == NULL) die("realloc");
+			}
+			ssize_t r = read(pfd[1].fd, buf + buflen, bufcap - buflen);
+			if (r == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+			if (r <= 0) {
+				editorFilterSplit(buf, buflen, 1, &rows, &nrows, &rowcap);
+				close(pfd[1].fd);
+				pfd[1].fd = -1;
+			} else {
+				buflen += r;
+				int used = editorFilterSplit(buf, buflen, 0, &rows, &nrows, &rowcap);
+				memmove(buf, buf + used, buflen - used);
+				buflen -= used;
+			}
+		}
+
+		if (pfd[2].revents) {
+			char c;
+			if ((pfd[2].revents & POLLIN) == 0 || read(STDIN_FILENO, &c, 1) != 1) {
+				pfd[2].fd = -1;
+			} else if (c == '\x1b') {
+				kill(pid, SIGKILL);
+				cancelled = 1;
+				if (pfd[0].fd != -1) close(pfd[0].fd);
+				close(pfd[1].fd);
+				pfd[0].fd = pfd[1].fd = -1;
+			}
+		}
+	}
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+	signal(SIGPIPE, oldpipe);
+	free(buf);
+
+	if (cancelled || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		int j;
+		for (j = 0; j < nrows; j++) editorFreeRow(&rows[j]);
+		free(rows);
+		if (cancelled) editorSetStatusMessage("Filter cancelled");
+		else if (WIFEXITED(status)) editorSetStatusMessage("%s: exited with %d, nothing changed", cmd, WEXITSTATUS(status));
+		else editorSetStatusMessage("%s: killed by signal %d, nothing changed", cmd, WTERMSIG(status));
+		LOG_WARN("Filter \"%s\" failed, status %d", cmd, status);
+		free(cmd);
+		return;
+	}
+
+	editorSpliceRows(at, n, rows, nrows, NULL);
+	free(rows);
+	E.mark = -1;
+	E.cy = at;
+	E.cx = 0;
+	editorSetStatusMessage("Filtered %d lines into %d", n, nrows);
+	free(cmd);
+}
+
+/*** regex ***/
+
+/* A small regex engine for searching. Patterns are compiled into Thompson
+ * NFAs which are turned into DFAs lazily while matching, so matching is
+ * linear in the row length and there is no backtracking. Supported are
+ * literals, '.', [] classes with ranges and negation, \d \w \s and their
+ * negations, grouping, '|', '*', '+' and '?'. A leading '^' or trailing '$'
+ * anchors the whole pattern to the start or end of the row. */
+
+enum reAstType { AST_SET, AST_CAT, AST_ALT, AST_STAR, AST_PLUS, AST_QUEST, AST_EMPTY };
+
+typedef struct reAst {
+	int type;
+	int l, r;
+	unsigned char set[32];
+} reAst;
+
+typedef struct reParser {
+	const char *pat;
+	int pos, len;
+	reAst *ast;
+	int nast;
+	int err;
+} reParser;
+
+#define RE_SETBIT(set, c) ((set)[(unsigned char) (c) >> 3] |= 1 << ((unsigned char) (c) & 7))
+#define RE_HASBIT(set, c) ((set)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+int reNewAst(reParser *p, int type, int l, int r)
+{
+	p->ast = realloc(p->ast, sizeof(reAst) * (p->nast + 1));
+	reAst *a = &p->ast[p->nast];
+	a->type = type;
+	a->l = l;
+	a->r = r;
+	memset(a->set, 0, sizeof(a->set));
+	return p->nast++;
+}
+
+/* add the class for escape c to set, returns 0 if c isn't a class */
+int reEscapeClass(unsigned char *set, int c)
+{
+	int j, neg = isupper(c);
+	unsigned char cls[32] = {0};
+
+	switch (tolower(c)) {
+		case 'd':
+			for (j = '0'; j <= '9'; j++) RE_SETBIT(cls, j);
+			break;
+		case 'w':
+			for (j = 0; j < 256; j++) if (isalnum(j) || j == '_') RE_SETBIT(cls, j);
+			break;
+		case 's':
+			for (j = 0; j < 256; j++) if (isspace(j)) RE_SETBIT(cls, j);
+			break;
+		default:
+			return 0;
+	}
+	for (j = 0; j < 32; j++) set[j] |= neg ? ~cls[j] : cls[j];
+	return 1;
+}
+
+int reEscapeChar(int c)
+{
+	if (c == 'n') return '\n';
+	if (c == 't') return '\t';
+	return c;
+}
+
+int reParseAlt(reParser *p);
+
+int reParseClass(reParser *p)
+{
+	int a = reNewAst(p, AST_SET, -1, -1);
+	unsigned char set[32] = {0};
+	int neg = 0, first = 1, j;
+
+	if (p->pos < p->len && p->pat[p->pos] == '^') {
+		neg = 1;
+		p->pos++;
+	}
+	while (p->pos < p->len && (first || p->pat[p->pos] != ']')) {
+		int c = (unsigned char) p->pat[p->pos++];
+		first = 0;
+		if (c == '\\' && p->pos < p->len) {
+			c = (unsigned char) p->pat[p->pos++];
+			if (reEscapeClass(set, c)) continue;
+			c = reEscapeChar(c);
+		}
+		if (p->pos + 1 < p->len && p->pat[p->pos] == '-' && p->pat[p->pos + 1] != ']') {
+			int hi = (unsigned char) p->pat[p->pos + 1];
+			p->pos += 2;
+			for (j = c; j <= hi; j++) RE_SETBIT(set, j);
+		} else {
+			RE_SETBIT(set, c);
+		}
+	}
+	if (p->pos >= p->len) {
+		p->err = 1;
+		return a;
+	}
+	p->pos++; /* ']' */
+	for (j = 0; j < 32; j++) p->ast[a].set[j] = neg ? ~set[j] : set[j];
+	return a;
+}
+
+int reParseAtom(reParser *p)
+{
+	int c = (unsigned char) p->pat[p->pos++];
+	int a;
+
+	switch (c) {
+		case '(':
+			a = reParseAlt(p);
+			if (p->pos >= p->len || p->pat[p->pos] != ')') p->err = 1;
+			else p->pos++;
+			return a;
+		case '[':
+			return reParseClass(p);
+		case '.':
+			a = reNewAst(p, AST_SET, -1, -1);
+			memset(p->ast[a].set, 0xff, 32);
+			return a;
+		case ')':
+		case '*':
+		case '+':
+		case '?':
+			p->err = 1;
+			return reNewAst(p, AST_EMPTY, -1, -1);
+	}
+
+	a = reNewAst(p, AST_SET, -1, -1);
+	if (c == '\\' && p->pos < p->len) {
+		c = (unsigned char) p->pat[p->pos++];
+		if (reEscapeClass(p->ast[a].set, c)) return a;
+		c = reEscapeChar(c);
+	}
+	RE_SETBIT(p->ast[a].set, c);
+	return a;
+}
+
+int reParseRepeat(reParser *p)
+{
+	int a = reParseAtom(p);
+	while (p->pos < p->len) {
+		char c = p->pat[p->pos];
+		if (c == '*') a = reNewAst(p, AST_STAR, a, -1);
+		else if (c == '+') a = reNewAst(p, AST_PLUS, a, -1);
+		else if (c == '?') a = reNewAst(p, AST_QUEST, a, -1);
+		else break;
+		p->pos++;
+	}
+	return a;
+}
+
+int reParseCat(reParser *p)
+{
+	int a = -1;
+	while (p->pos < p->len && p->pat[p->pos] != '|' && p->pat[p->pos] != ')' && !p->err) {
+		int b = reParseRepeat(p);
+		a = a == -1 ? b : reNewAst(p, AST_CAT, a, b);
+	}
+	return a == -1 ? reNewAst(p, AST_EMPTY, -1, -1) : a;
+}
+
+int reParseAlt(reParser *p)
+{
+	int a = reParseCat(p);
+	while (p->pos < p->len && p->pat[p->pos] == '|' && !p->err) {
+		p->pos++;
+		a = reNewAst(p, AST_ALT, a, reParseCat(p));
+	}
+	return a;
+}
+
+int reNewNode(reDfa *d, int type, int out, int out1)
+{
+	d->nfa = realloc(d->nfa, sizeof(reNode) * (d->nnodes + 1));
+	reNode *n = &d->nfa[d->nnodes];
+	n->type = type;
+	n->out = out;
+	n->out1 = out1;
+	memset(n->set, 0, sizeof(n->set));
+	return d->nnodes++;
+}
+
+/* Thompson construction of ast node a. The fragment starts at the returned
+ * node and ends in the epsilon node *end, whose out is left unconnected. In
+ * reverse, concatenations are built back to front. */
+int reCompileAst(reDfa *d, reAst *ast, int a, int reverse, int *end)
+{
+	int s, e, s1, e1, s2, e2;
+
+	switch (ast[a].type) {
+		case AST_SET:
+			e = reNewNode(d, RE_EPS, -1, -1);
+			s = reNewNode(d, RE_SET, e, -1);
+			memcpy(d->nfa[s].set, ast[a].set, 32);
+			break;
+		case AST_CAT:
+			s1 = reCompileAst(d, ast, reverse ? ast[a].r : ast[a].l, reverse, &e1);
+			s2 = reCompileAst(d, ast, reverse ? ast[a].l : ast[a].r, reverse, &e2);
+			d->nfa[e1].out = s2;
+			s = s1;
+			e = e2;
+			break;
+		case AST_ALT:
+			s1 = reCompileAst(d, ast, ast[a].l, reverse, &e1);
+			s2 = reCompileAst(d, ast, ast[a].r, reverse, &e2);
+			e = reNewNode(d, RE_EPS, -1, -1);
+			s = reNewNode(d, RE_EPS, s1, s2);
+			d->nfa[e1].out = e;
+			d->nfa[e2].out = e;
+			break;
+		case AST_STAR:
+		case AST_QUEST:
+			s1 = reCompileAst(d, ast, ast[a].l, reverse, &e1);
+			e = reNewNode(d, RE_EPS, -1, -1);
+			s = reNewNode(d, RE_EPS, s1, e);
+			d->nfa[e1].out = ast[a].type == AST_STAR ? s : e;
+			break;
+		case AST_PLUS:
+			s = reCompileAst(d, ast, ast[a].l, reverse, &e1);
+			e = reNewNode(d, RE_EPS, -1, -1);
+			s2 = reNewNode(d, RE_EPS, s, e);
+			d->nfa[e1].out = s2;
+			break;
+		default:
+			e = reNewNode(d, RE_EPS, -1, -1);
+			s = reNewNode(d, RE_EPS, e, -1);
+			break;
+	}
+	*end = e;
+	return s;
+}
+
+/* the longest string node n can match, -1 if there is no limit */
+int reMaxLen(reAst *ast, int n)
+{
+	int l, r;
+	switch (ast[n].type) {
+		case AST_SET:
+			return 1;
+		case AST_CAT:
+		case AST_ALT:
+			l = reMaxLen(ast, ast[n].l);
+			r = reMaxLen(ast, ast[n].r);
+			if (l == -1 || r == -1) return -1;
+			if (ast[n].type == AST_CAT) return l + r;
+			return l > r ? l : r;
+		case AST_STAR:
+		case AST_PLUS:
+			return -1;
+		case AST_QUEST:
+			return reMaxLen(ast, ast[n].l);
+		default:
+			return 0;
+	}
+}
+
+void reDfaInit(reDfa *d, reAst *ast, int root, int reverse, int unanchored)
+{
+	int end;
+	memset(d, 0, sizeof(reDfa));
+	d->start = reCompileAst(d, ast, root, reverse, &end);
+	int match = reNewNode(d, RE_MATCH, -1, -1);
+	d->nfa[end].out = match;
+	d->unanchored = unanchored;
+	d->startstate = -1;
+
+	d->trans = malloc(sizeof(int) * 256 * KILO_RE_MAX_STATES);
+	d->accept = malloc(sizeof(int) * KILO_RE_MAX_STATES);
+	d->setoff = malloc(sizeof(int) * KILO_RE_MAX_STATES);
+	d->setlen = malloc(sizeof(int) * KILO_RE_MAX_STATES);
+	d->hash = malloc(sizeof(int) * KILO_RE_MAX_STATES * 2);
+	memset(d->hash, -1, sizeof(int) * KILO_RE_MAX_STATES * 2);
+	d->mark = calloc(d->nnodes, sizeof(int));
+	d->buf = malloc(sizeof(int) * d->nnodes);
+	d->stack = malloc(sizeof(int) * d->nnodes * 2);
+}
+
+void reDfaFree(reDfa *d)
+{
+	free(d->nfa);
+	free(d->trans);
+	free(d->accept);
+	free(d->setoff);
+	free(d->setlen);
+	free(d->pool);
+	free(d->hash);
+	free(d->mark);
+	free(d->buf);
+	free(d->stack);
+}
+
+/* drop every cached state, the cache has filled up */
+void reDfaFlush(reDfa *d)
+{
+	LOG_DEBUG("Flushing %d DFA states.", d->nstates);
+	d->nstates = 0;
+	d->poollen = 0;
+	d->startstate = -1;
+	memset(d->hash, -1, sizeof(int) * KILO_RE_MAX_STATES * 2);
+}
+
+/* add the epsilon closure of node n to d->buf */
+void reDfaClosure(reDfa *d, int n, int *len)
+{
+	int sp = 0;
+	d->stack[sp++] = n;
+	while (sp > 0) {
+		n = d->stack[--sp];
+		if (n == -1 || d->mark[n] == d->gen) continue;
+		d->mark[n] = d->gen;
+		if (d->nfa[n].type == RE_EPS) {
+			d->stack[sp++] = d->nfa[n].out;
+			d->stack[sp++] = d->nfa[n].out1;
+		} else {
+			d->buf[(*len)++] = n;
+		}
+	}
+}
+
+int reCmpInt(const void *a, const void *b)
 {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++, rx++)
-		if (row->chars[j] == '\t')
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-	return rx;
+	return *(const int *) a - *(const int *) b;
 }
 
-void editorUpdateRow(erow *row)
+/* Find or create the state for the node set in d->buf. Returns -1 when the
+ * cache is full. */
+int reDfaState(reDfa *d, int len)
 {
+	unsigned int h = 2166136261u;
 	int j;
 
-	/* count the tabs */
-	int tabs = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') tabs++;
-	}
+	qsort(d->buf, len, sizeof(int), reCmpInt);
+	for (j = 0; j < len; j++) h = (h ^ d->buf[j]) * 16777619u;
 
-	free(row->render);
-	row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+	unsigned int slot = h % (KILO_RE_MAX_STATES * 2);
+	while (d->hash[slot] != -1) {
+		int st = d->hash[slot];
+		if (d->setlen[st] == len &&
+			memcmp(&d->pool[d->setoff[st]], d->buf, sizeof(int) * len) == 0)
+			return st;
+		slot = (slot + 1) % (KILO_RE_MAX_STATES * 2);
+	}
+	if (d->nstates == KILO_RE_MAX_STATES) return -1;
+
+	int st = d->nstates++;
+	d->pool = realloc(d->pool, sizeof(int) * (d->poollen + len + 1));
+	memcpy(&d->pool[d->poollen], d->buf, sizeof(int) * len);
+	d->setoff[st] = d->poollen;
+	d->setlen[st] = len;
+	d->poollen += len;
+
+	d->accept[st] = 0;
+	for (j = 0; j < len; j++)
+		if (d->nfa[d->buf[j]].type == RE_MATCH) d->accept[st] = 1;
+	for (j = 0; j < 256; j++) d->trans[st * 256 + j] = -1;
+	d->hash[slot] = st;
+	return st;
+}
 
-	/* render chars correctly */
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
+int reDfaStart(reDfa *d)
+{
+	if (d->startstate == -1) {
+		int len = 0;
+		d->gen++;
+		reDfaClosure(d, d->start, &len);
+		d->startstate = reDfaState(d, len);
+		if (d->startstate == -1) {
+			reDfaFlush(d);
+			d->startstate = reDfaState(d, len);
+		}
+	}
+	return d->startstate;
+}
 
-		/* Tabs */
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+int reDfaStep(reDfa *d, int st, unsigned char c)
+{
+	int next = d->trans[st * 256 + c];
+	if (next != -1) return next;
+
+	int j, len = 0;
+	d->gen++;
+	for (j = 0; j < d->setlen[st]; j++) {
+		reNode *n = &d->nfa[d->pool[d->setoff[st] + j]];
+		if (n->type == RE_SET && RE_HASBIT(n->set, c)) reDfaClosure(d, n->out, &len);
+	}
+	if (d->unanchored) reDfaClosure(d, d->start, &len);
 
-		/* normal text */
-		} else {
-			row->render[idx++] = row->chars[j];
-		}
+	next = reDfaState(d, len);
+	if (next == -1) {
+		/* the old state is gone after the flush, so nothing is cached */
+		reDfaFlush(d);
+		return reDfaState(d, len);
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	d->trans[st * 256 + c] = next;
+	return next;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+int reDfaDead(reDfa *d, int st)
 {
-	if (at < 0 || at > E.numrows) return;
+	return d->setlen[st] == 0;
+}
+
+/* Returns NULL if the pattern doesn't parse. */
+regex *reCompile(const char *pattern)
+{
+	reParser p = {pattern, 0, strlen(pattern), NULL, 0, 0};
+	regex *re = malloc(sizeof(regex));
+	re->bol = re->eol = 0;
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	if (p.len > 0 && p.pat[0] == '^') {
+		re->bol = 1;
+		p.pos++;
+	}
+	if (p.len > p.pos && p.pat[p.len - 1] == '$') {
+		int escapes = 0;
+		while (p.len - 2 - escapes >= p.pos && p.pat[p.len - 2 - escapes] == '\\') escapes++;
+		if (escapes % 2 == 0) {
+			re->eol = 1;
+			p.len--;
+		}
+	}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	int root = reParseAlt(&p);
+	if (p.err || p.pos != p.len) {
+		LOG_DEBUG("Can't parse regex \"%s\" at %d.", pattern, p.pos);
+		free(p.ast);
+		free(re);
+		return NULL;
+	}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow(&E.row[at]);
-	E.numrows++;
-	E.dirty++;
+	reDfaInit(&re->fwd, p.ast, root, 0, 0);
+	reDfaInit(&re->rev, p.ast, root, 1, !re->eol);
+	re->maxlen = reMaxLen(p.ast, root);
+	free(p.ast);
+	return re;
 }
 
-void editorFreeRow(erow *row)
+void reFree(regex *re)
 {
-	free(row->chars);
-	free(row->render);
+	if (re == NULL) return;
+	reDfaFree(&re->fwd);
+	reDfaFree(&re->rev);
+	free(re);
 }
 
-void editorDelRow(int at)
+/* Find the leftmost longest match in s[from, to), s being len long, which is
+ * where '$' matches. Returns where it starts, or -1, and its length in
+ * *mlen. Scanning backwards from to with the reversed pattern finds the
+ * leftmost position a match starts at, scanning forwards from there finds
+ * where the longest match ends. Both passes are linear in to - from. */
+int reSearch(regex *re, const char *s, int len, int from, int to, int *mlen)
 {
-	if (at < 0 || at >= E.numrows) return;
-	LOG_DEBUG("Deleting row %d.", at);
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	E.numrows--;
-	E.dirty++;
+	int start = -1, end = -1, st, i;
+
+	if (re->eol && to < len) return -1;
+	if (re->bol) {
+		if (from > 0) return -1;
+		start = 0;
+	} else {
+		st = reDfaStart(&re->rev);
+		if (re->rev.accept[st]) start = to;
+		for (i = to - 1; i >= from; i--) {
+			st = reDfaStep(&re->rev, st, s[i]);
+			if (reDfaDead(&re->rev, st)) break;
+			if (re->rev.accept[st]) start = i;
+		}
+		if (start == -1) return -1;
+	}
+
+	st = reDfaStart(&re->fwd);
+	if (re->fwd.accept[st] && (!re->eol || start == len)) end = start;
+	for (i = start; i < to; i++) {
+		st = reDfaStep(&re->fwd, st, s[i]);
+		if (reDfaDead(&re->fwd, st)) break;
+		if (re->fwd.accept[st] && (!re->eol || i + 1 == len)) end = i + 1;
+	}
+	if (end == -1) return -1;
+
+	*mlen = end - start;
+	return start;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+/*** find ***/
+
+void editorSetFindQuery(char *query)
 {
-	LOG_DEBUG("Appending \"%s\" to \"%s\"", row->chars, s);
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+	free(E.findquery);
+	reFree(E.findre);
+	E.findquery = NULL;
+	E.findre = NULL;
+	if (query == NULL || query[0] == '\0') return;
+
+	E.findquery = strdup(query);
+	if (E.findregex) E.findre = reCompile(query);
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+/* Find the first match in row within chars [from, to). Rows are searched in
+ * place, returns the match start or -1 and its length in *mlen. */
+int editorFindInRow(erow *row, int from, int to, int *mlen)
 {
-	LOG_DEBUG("Inserting Character %c at position %d in row %d.", c, at, E.cy);
-	if (at < 0 || at > row->size) at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+	if (E.findquery == NULL || from > to) return -1;
+
+	if (E.findregex) {
+		if (E.findre == NULL) return -1;
+		return reSearch(E.findre, editorRowWindow(row, from, to), row->size,
+						from, to, mlen);
+	}
+
+	char *chars = editorRowWindow(row, from, to);
+	*mlen = strlen(E.findquery);
+	char *match = memmem(chars + from, to - from, E.findquery, *mlen);
+	return match ? match - chars : -1;
 }
 
-void editorRowDeleteChar(erow *row, int at)
+/* How many chars a match can reach beyond where it starts or ends in view,
+ * matches longer than that are only highlighted within a screen width. */
+int editorFindReach()
 {
-	LOG_DEBUG("Deleting Character %c at position %d in row %d.",
-			   row->chars[at], at, E.cy);
-	if (at < 0 || at > row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+	if (!E.findregex) return strlen(E.findquery);
+	if (E.findre == NULL || E.findre->maxlen == -1) return E.screencols;
+	return E.findre->maxlen;
 }
 
-
-/*** editor operations ***/
-
-void editorInsertChar(int c)
+void editorFindPrompt()
 {
-	if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	snprintf(E.findprompt, sizeof(E.findprompt), "%s: %%s (ESC/Arrows/Enter, ^E %s)",
+			 E.findregex ? "Regex" : "Search", E.findregex ? "literal" : "regex");
 }
 
-void editorInsertNewline() {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
+void editorFindCallback(char *query, int key)
+{
+	static int last_match = -1;
+	static int direction = 1;
+
+	if (key == '\r' || key == '\x1b') {
+		last_match = -1;
+		direction = 1;
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	} else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
 	} else {
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		if (key == CTRL_KEY('e')) {
+			E.findregex = !E.findregex;
+			editorFindPrompt();
+		}
+		last_match = -1;
+		direction = 1;
+	}
+
+	if (E.findquery == NULL || strcmp(E.findquery, query) != 0 || key == CTRL_KEY('e'))
+		editorSetFindQuery(query);
+	if (E.findquery == NULL) return;
+
+	if (last_match == -1) direction = 1;
+	int current = last_match;
+	int i, mlen;
+	for (i = 0; i < E.numrows; i++) {
+		current += direction;
+		if (current == -1) current = E.numrows - 1;
+		else if (current == E.numrows) current = 0;
+
+		int at = editorFindInRow(&E.row[current], 0, E.row[current].size, &mlen);
+		if (at != -1) {
+			last_match = current;
+			E.cy = current;
+			E.cx = at;
+			break;
+		}
 	}
-	E.cy++;
-	E.cx = 0;
 }
 
-void editorDeleteChar()
+/* Incremental search, the matches stay highlighted until ESC is pressed. */
+void editorFind()
 {
-	if (E.cy == E.numrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
-
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDeleteChar(row, E.cx - 1);
-		E.cx--;
-	} else if (E.cx == 0) {
-		E.cx = E.row[E.cy - 1].size;
-		LOG_DEBUG("Appending row %d string to row %d end.", E.cy, E.cy - 1);
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_rowoff = E.rowoff;
+	int saved_coloff = E.coloff;
+	int saved_voff = E.voff;
+
+	editorFindPrompt();
+	char *query = editorPrompt(E.findprompt, editorFindCallback);
+	if (query) {
+		free(query);
 	} else {
-		LOG_ERROR("E.cx < 0: E.cx = %d", E.cx);
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.rowoff = saved_rowoff;
+		E.coloff = saved_coloff;
+		E.voff = saved_voff;
+		editorSetFindQuery(NULL);
 	}
 }
 
-/*** file i/o ***/
+/*** buffers ***/
 
-char *editorRowsToString(int *buflen)
+void editorStoreBuffer(editorBuffer *b)
 {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; totlen += E.row[j++].size + 1);
-	*buflen = totlen;
-
-	char *buf = malloc(sizeof(char) * totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
-	}
-
-	return buf;
+	editorGapClose();
+	b->cx = E.cx;
+	b->cy = E.cy;
+	b->rx = E.rx;
+	b->rowoff = E.rowoff;
+	b->coloff = E.coloff;
+	b->numrows = E.numrows;
+	b->row = E.row;
+	b->dirty = E.dirty;
+	b->filename = E.filename;
+	b->loaded = 1;
+	b->voff = E.voff;
+	b->wrapidx = E.wrapidx;
+	b->wrapvalid = E.wrapvalid;
+	b->wrapcols = E.wrapcols;
+	b->follow = E.follow;
+	b->followoff = E.followoff;
+	b->followino = E.followino;
+	b->followmtime = E.followmtime;
+	b->followpartial = E.followpartial;
+	b->arena = E.arena;
+	b->arenalen = E.arenalen;
 }
 
-void editorOpen(char *filename)
+void editorRestoreBuffer(editorBuffer *b)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
-	FILE *fp = fopen(filename, "r");
-	LOG_INFO("Opening %s for reading", filename);
-	if (!fp) die("fopen");
-
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-							   line[linelen - 1] == '\r'))
-			linelen--;
-		LOG_DEBUG("length %d: %s\033[A", linelen, line);
-		editorInsertRow(E.numrows, line, linelen);
-	}
-	free(line);
-	LOG_INFO("Closing %s after reading from it", filename);
-	fclose(fp);
-	E.dirty = 0;
+	editorRxMarkDrop(NULL, -1);
+	E.cx = b->cx;
+	E.cy = b->cy;
+	E.rx = b->rx;
+	E.rowoff = b->rowoff;
+	E.coloff = b->coloff;
+	E.numrows = b->numrows;
+	E.row = b->row;
+	E.dirty = b->dirty;
+	E.filename = b->filename;
+	E.voff = b->voff;
+	E.wrapidx = b->wrapidx;
+	E.wrapvalid = b->wrapvalid;
+	E.wrapcols = b->wrapcols;
+	E.follow = b->follow;
+	E.followoff = b->followoff;
+	E.followino = b->followino;
+	E.followmtime = b->followmtime;
+	E.followpartial = b->followpartial;
+	E.arena = b->arena;
+	E.arenalen = b->arenalen;
 }
 
-void editorSave()
+int editorAddBuffer(char *filename)
 {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)");
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save Aborted");
-			return;
+	int i;
+	char *path = filename ? editorRealPath(filename) : NULL;
+	for (i = 0; path && i < E.numbufs; i++) {
+		if (E.buf[i].filename == NULL) continue;
+		char *other = editorRealPath(E.buf[i].filename);
+		int same = strcmp(other, path) == 0;
+		free(other);
+		if (same) {
+			LOG_INFO("Reusing buffer %d for %s", i, filename);
+			free(path);
+			return i;
 		}
 	}
+	free(path);
 
-	int len;
-	char *buf = editorRowsToString(&len);
+	E.buf = realloc(E.buf, sizeof(editorBuffer) * (E.numbufs + 1));
+	if (E.buf == NULL) die("realloc");
 
-	LOG_INFO("Opening file %s to write.", E.filename);
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
+	editorBuffer *b = &E.buf[E.numbufs];
+	memset(b, 0, sizeof(editorBuffer));
+	b->filename = filename ? strdup(filename) : NULL;
+	b->loaded = (filename == NULL);
+	LOG_INFO("Added buffer %d for %s", E.numbufs, filename ? filename : "[No Name]");
+	return E.numbufs++;
+}
 
-		LOG_INFO("Truncating file to new length %d...", len);
-		if (ftruncate(fd, len) != -1) {
+void editorSwitchBuffer(int at)
+{
+	if (at < 0 || at >= E.numbufs || at == E.curbuf) return;
+	LOG_INFO("Switching from buffer %d to buffer %d", E.curbuf, at);
+
+	/* the rows stay resident, so switching back doesn't read the file again */
+	if (E.curbuf != -1) editorStoreBuffer(&E.buf[E.curbuf]);
+	editorFreeUndo();
+	E.mark = -1;
+	E.curbuf = at;
+	editorRestoreBuffer(&E.buf[at]);
+
+	/* files are only read the first time their buffer is shown, after that
+	 * only when they changed on disk meanwhile */
+	if (!E.buf[at].loaded) {
+		editorOpen(E.filename);
+		editorStoreBuffer(&E.buf[at]);
+	} else if (!E.follow) {
+		editorFileCheck();
+	}
 
-			LOG_INFO("Writing to file...");
-			if (write(fd, buf, len) == len) {
+	/* only the current buffer is watched, catch up on what was missed */
+	editorFollowWatch();
+	if (E.follow) editorFollowCheck();
+}
 
-				LOG_INFO("%d bytes written to %s successfully.", len, E.filename);
-				LOG_INFO("Closing %s.", E.filename);
-				close(fd);
-				free(buf);
-				editorSetStatusMessage("%d bytes written to disk in %s", len, E.filename);
-				E.dirty = 0;
-				return;
-			}
+/* Add buffers for the files in argv, files after a -f are followed. Returns
+ * the buffer of the first file, or -1 if there were none. */
+int editorOpenArgs(int argc, char *argv[])
+{
+	int i, follow = 0, first = -1;
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			follow = 1;
+			continue;
 		}
-
-		LOG_INFO("Closing %s.", E.filename);
-		close(fd);
+		int at = editorAddBuffer(argv[i]);
+		if (follow) E.buf[at].follow = 1;
+		if (first == -1) first = at;
 	}
-
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return first;
 }
 
 /*** append buffer ***/
@@ -492,6 +2823,8 @@ void abAppend(struct abuf *ab, const char *s, int len)
 {
 	char *new;
 
+	/* realloc to 0 bytes would free a reused, emptied buffer */
+	if (len == 0) return;
 	if ((new = realloc(ab->b, ab->len + len)) == NULL) die("realloc");
 	memcpy(&new[ab->len], s, len);
 	ab->b = new;
@@ -505,7 +2838,7 @@ void abFree(struct abuf *ab)
 
 /*** input ***/
 
-char *editorPrompt(char *prompt)
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
 {
 	size_t bufsize = 128;
 	char *buf = malloc(bufsize);
@@ -523,14 +2856,16 @@ char *editorPrompt(char *prompt)
 			if (buflen != 0) buf[--buflen] = '\0';
 		} else if (c == '\x1b') {
 			editorSetStatusMessage("");
+			if (callback) callback(buf, c);
+			free(buf);
 			LOG_INFO("Exiting Prompt Loop by ESC.");
 			return NULL;
 		} else if (c == '\r') {
-			if (buflen != 0) {
-				editorSetStatusMessage("");
-				LOG_INFO("Exiting Prompt Loop by ENTER.");
-				return buf;
-			}
+			/* callers that need an answer check for an empty one */
+			editorSetStatusMessage("");
+			if (callback) callback(buf, c);
+			LOG_INFO("Exiting Prompt Loop by ENTER.");
+			return buf;
 		} else if (!iscntrl(c) && c < 128) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
@@ -539,6 +2874,8 @@ char *editorPrompt(char *prompt)
 			buf[buflen++] = c;
 			buf[buflen] = '\0';
 		}
+
+		if (callback) callback(buf, c);
 	}
 }
 
@@ -589,6 +2926,10 @@ void editorProcessKeypress()
 	static int quit_times = KILO_DIRTY_QUIT_TIMES;
 	int c = editorReadKey();
 
+	/* control keys run commands that want whole rows, only typing and
+	 * moving around keep a long row's gap */
+	if (c < ' ' && c != '\t' && c != CTRL_KEY('h')) editorGapClose();
+
 	switch (c) {
 		case '\r':
 			editorInsertNewline();
@@ -602,15 +2943,60 @@ void editorProcessKeypress()
 			}
 			write(STDOUT_FILENO, "\x1b[2J", 4); /* clears screen */
 			write(STDOUT_FILENO, "\x1b[H", 3); /* resetes cursor position */
-
-			closeLogFile();
-			exit(0);
+			E.quit = 1;
 			break;
 
 		case CTRL_KEY('s'):
 			editorSave();
 			break;
 
+		case CTRL_KEY('f'):
+			editorFind();
+			break;
+
+		case CTRL_KEY('r'):
+			editorReplace();
+			break;
+
+		case CTRL_KEY('k'):
+			editorFilterRows();
+			break;
+
+		case CTRL_KEY('z'):
+			editorUndoReplace();
+			break;
+
+		case CTRL_KEY('b'):
+			editorToggleMark();
+			break;
+
+		case CTRL_KEY('x'):
+			editorCutRows();
+			break;
+
+		case CTRL_KEY('c'):
+			editorCopyRows();
+			break;
+
+		case CTRL_KEY('v'):
+			editorPasteRows();
+			break;
+
+		case CTRL_KEY('w'):
+			editorToggleWrap();
+			break;
+
+		case CTRL_KEY('t'):
+			editorToggleFollow();
+			break;
+
+		case CTRL_KEY('n'):
+		case CTRL_KEY('p'):
+			if (E.numbufs > 1)
+				editorSwitchBuffer((E.curbuf + (c == CTRL_KEY('n') ? 1 : E.numbufs - 1))
+								   % E.numbufs);
+			break;
+
 		case HOME_KEY:
 			E.cx = 0;
 			break;
@@ -652,8 +3038,11 @@ void editorProcessKeypress()
 			break;
 
 		case CTRL_KEY('l'):
+			E.shadowvalid = 0;
+			break;
+
 		case '\x1b':
-			/* TODO: */
+			editorSetFindQuery(NULL);
 			break;
 
 		default:
@@ -673,6 +3062,21 @@ void editorScroll()
 		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
 	}
 
+	/* Soft wrapped scrolling works in visual lines */
+	if (E.wrap) {
+		editorWrapIndex();
+		int v = editorWrapCursor();
+		if (v < E.voff) {
+			E.voff = v;
+		}
+		if (v >= E.voff + E.screenrows) {
+			E.voff = v - E.screenrows + 1;
+		}
+		E.rowoff = editorWrapFind(E.voff, NULL);
+		E.coloff = 0;
+		return;
+	}
+
 	/* Vertical Scrolling */
 	if (E.cy < E.rowoff) {
 		E.rowoff = E.cy;
@@ -690,14 +3094,144 @@ void editorScroll()
 	}
 }
 
+/* The shadow holds what every screen row currently shows. A pure vertical
+ * scroll is done by the terminal inside a DECSTBM scroll region, after which
+ * only the rows whose contents differ from the shadow are sent. */
+
+void editorResetShadow()
+{
+	int y;
+	if (E.shadowrows != E.screenrows) {
+		for (y = 0; y < E.shadowrows; y++) free(E.shadow[y]);
+		E.shadow = realloc(E.shadow, sizeof(char *) * E.screenrows);
+		E.shadowlen = realloc(E.shadowlen, sizeof(int) * E.screenrows);
+		for (y = 0; y < E.screenrows; y++) E.shadow[y] = NULL;
+		E.shadowrows = E.screenrows;
+	}
+	for (y = 0; y < E.shadowrows; y++) E.shadowlen[y] = -1;
+	E.shadowvalid = 1;
+}
+
+void editorScrollScreen(struct abuf *ab)
+{
+	int top = E.wrap ? E.voff : E.rowoff;
+	int d = top - E.shadowtop;
+	int rows = E.screenrows;
+
+	if (!E.shadowvalid || E.shadowrows != rows || E.shadowwrap != E.wrap) {
+		editorResetShadow();
+		d = 0;
+	}
+	E.shadowtop = top;
+	E.shadowwrap = E.wrap;
+	if (d == 0) return;
+	if (d >= rows || d <= -rows) {
+		editorResetShadow();
+		return;
+	}
+
+	/* scroll the text area only, leaving the status and message bars be */
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+					   rows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+	abAppend(ab, buf, len);
+	LOG_DEBUG("Scrolled screen by %d rows.", d);
+
+	/* rotate the shadow the same way, the exposed rows are unknown */
+	char *moved[rows];
+	int n = d > 0 ? d : -d;
+	int y;
+	if (d > 0) {
+		memcpy(moved, E.shadow, sizeof(char *) * n);
+		memmove(E.shadow, E.shadow + n, sizeof(char *) * (rows - n));
+		memmove(E.shadowlen, E.shadowlen + n, sizeof(int) * (rows - n));
+		memcpy(E.shadow + rows - n, moved, sizeof(char *) * n);
+		for (y = rows - n; y < rows; y++) E.shadowlen[y] = -1;
+	} else {
+		memcpy(moved, E.shadow + rows - n, sizeof(char *) * n);
+		memmove(E.shadow + n, E.shadow, sizeof(char *) * (rows - n));
+		memmove(E.shadowlen + n, E.shadowlen, sizeof(int) * (rows - n));
+		memcpy(E.shadow, moved, sizeof(char *) * n);
+		for (y = 0; y < n; y++) E.shadowlen[y] = -1;
+	}
+}
+
+/* send screen row y only if it differs from what is already shown */
+void editorDrawLine(struct abuf *ab, int y, struct abuf *line)
+{
+	if (E.shadowlen[y] == line->len &&
+		memcmp(E.shadow[y], line->b, line->len) == 0) return;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+	abAppend(ab, buf, len);
+	abAppend(ab, line->b, line->len);
+
+	E.shadow[y] = realloc(E.shadow[y], line->len);
+	memcpy(E.shadow[y], line->b, line->len);
+	E.shadowlen[y] = line->len;
+}
+
+/* Append render columns [off, off + len) of row with the find matches in
+ * them highlighted. Only the visible chars are searched, widened by as far
+ * as a match can reach into them, so long rows cost no more than short
+ * ones. */
+void editorDrawRowText(struct abuf *line, erow *row, int off, int len, char *slice)
+{
+	char *text = editorRowRender(row, off, len, slice);
+	int done = 0, at, mlen;
+
+	if (E.findquery == NULL) {
+		abAppend(line, text, len);
+		return;
+	}
+	int reach = editorFindReach();
+	int from = editorRowRxToCx(row, off) - reach;
+	int to = editorRowRxToCx(row, off + len) + reach;
+	if (from < 0) from = 0;
+	if (to > row->size) to = row->size;
+
+	/* matches come in order, so the columns are walked forward only once */
+	int cx = from, rx = editorRowCxToRx(row, from);
+	while ((at = editorFindInRow(row, from, to, &mlen)) != -1) {
+		if (mlen == 0) {
+			from = at + 1;
+			continue;
+		}
+		rx = editorRowCxToRxFrom(row, cx, rx, at);
+		int start = rx - off;
+		rx = editorRowCxToRxFrom(row, at, rx, at + mlen);
+		cx = at + mlen;
+		int end = rx - off;
+		if (start >= len) break;
+		from = at + mlen;
+		if (end <= done) continue;
+		if (start < done) start = done;
+		if (end > len) end = len;
+
+		abAppend(line, text + done, start - done);
+		abAppend(line, "\x1b[34m", 5);
+		abAppend(line, text + start, end - start);
+		abAppend(line, "\x1b[39m", 5);
+		done = end;
+	}
+	abAppend(line, text + done, len - done);
+}
+
 void editorDrawRows(struct abuf *ab)
 {
 	int y, welcome_len, padding, filerow;
 	char welcome[80];
+	int sel, nsel = editorSelection(&sel);
+	int wsub = 0, wrow = E.wrap ? editorWrapFind(E.voff, &wsub) : 0;
+	char *slice = malloc(E.screencols);
+	struct abuf line = ABUF_INIT;
 	LOG_DEBUG("Drawing screen...");
+	editorScrollScreen(ab);
 	//LOG_DEBUG("Start drawing screen at rowoff = %d", E.rowoff);
 	for (y = 0; y < E.screenrows; y++) {
-		filerow = y + E.rowoff;
+		filerow = E.wrap ? wrow : y + E.rowoff;
+		line.len = 0;
 		if (filerow >= E.numrows) {
 			if (E.numrows == 0 && y == E.screenrows / 3) {
 
@@ -711,34 +3245,48 @@ void editorDrawRows(struct abuf *ab)
 				/* Center the welcome message */
 				padding = (E.screencols - welcome_len) / 2;
 				if (padding) {
-					abAppend(ab, "|", 1);
+					abAppend(&line, "|", 1);
 					padding--;
 				}
-				while (padding--) abAppend(ab, " ", 1);
+				while (padding--) abAppend(&line, " ", 1);
 
 				/* add the welcome message into the main buffer */
-				abAppend(ab, welcome, welcome_len);
+				abAppend(&line, welcome, welcome_len);
 				//LOG_DEBUG("Drew file row %d with welcome message", filerow);
 			} else {
-				abAppend(ab, "|", 1);
+				abAppend(&line, "|", 1);
 				//LOG_DEBUG("Drew file row %d with string |", filerow);
 			}
 
 		/* Draw non empty rows */
 		} else {
-			int len = E.row[filerow].rsize - E.coloff;
+			erow *row = &E.row[filerow];
+			int off = E.wrap ? wsub * E.screencols : E.coloff;
+			int len = row->rsize - off;
 			if (len < 0) len = 0;
 			if (len > E.screencols) len = E.screencols;
-			abAppend(ab, &E.row[filerow].render[E.coloff], len);
-			//LOG_DEBUG("Drew file row %d with string %s", filerow, E.row[filerow].render);
+
+			/* selected rows are drawn inverted */
+			int selected = E.mark != -1 && filerow >= sel && filerow < sel + nsel;
+			if (selected) abAppend(&line, "\x1b[7m", 4);
+			editorDrawRowText(&line, row, off, len, slice);
+			if (selected) abAppend(&line, "\x1b[m", 3);
+
+			/* move on to the next visual line of the row, or the next row */
+			if (E.wrap && ++wsub == editorRowVlines(row)) {
+				wsub = 0;
+				wrow++;
+			}
+			//LOG_DEBUG("Drew file row %d with string %s", filerow, E.row[filerow].chars);
 		}
 
 		/* erase everything to the right of the cursor */
-		abAppend(ab, "\x1b[K", 3);
+		abAppend(&line, "\x1b[K", 3);
 
-		/* insert cariage return at every new row */
-		abAppend(ab, "\r\n", 2);
+		editorDrawLine(ab, y, &line);
 	}
+	abFree(&line);
+	free(slice);
 	LOG_DEBUG("Drawing screen finished.");
 }
 
@@ -748,7 +3296,8 @@ void editorDrawStatus(struct abuf *ab)
 	abAppend(ab, "\x1b[7m", 4);
 
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), " %.20s - %d lines %s", 
+	int len = snprintf(status, sizeof(status), " [%d/%d] %.20s - %d lines %s",
+					E.curbuf + 1, E.numbufs,
 					E.filename ? E.filename : "[No Name]", E.numrows,
 					E.dirty ? "(Modified)" : "");
 	int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d ",
@@ -797,13 +3346,22 @@ void editorRefreshScreen()
 	abAppend(&ab, "\x1b[H", 3);
 
 	editorDrawRows(&ab);
+
+	/* the rows are drawn out of order, so place the status bar explicitly */
+	char pos[32];
+	int poslen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.screenrows + 1);
+	abAppend(&ab, pos, poslen);
 	editorDrawStatus(&ab);
 	editorDrawMessageBar(&ab);
 
 	/* moves the cursor to wherever E.cy - E.rowoff (row on the screen) and E.cx - E.coloff (cols on the screen) is */
 	char buf[32];
-	unsigned int buf_len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-								    (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+	int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+	if (E.wrap) {
+		cy = editorWrapCursor() - E.voff;
+		cx = E.rx % E.wrapcols;
+	}
+	unsigned int buf_len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
 	if (buf_len >= sizeof(buf)) buf_len = sizeof(buf) - 1;
 	abAppend(&ab, buf, buf_len);
 
@@ -887,6 +3445,260 @@ void logm(const char *level, const char *func, int line, const char *format, ...
 	if (bytes_written < len) die("Write to Log file, Not enough space");
 }
 
+/*** server ***/
+
+/* With --server kilo keeps running as a daemon that holds the buffers, so a
+ * file only has to be read once. Clients attach with --attach by passing
+ * their terminal's descriptors over a Unix socket, and Ctrl-Q detaches
+ * again instead of quitting. Clients are served one at a time. */
+
+/* The socket goes in the user's private runtime directory, and in /tmp
+ * only when there is none. */
+void editorSocketPath(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	char *dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && dir[0] == '/' &&
+		strlen(dir) + strlen(KILO_SOCKET_NAME) + 1 < sizeof(addr->sun_path)) {
+		snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, KILO_SOCKET_NAME);
+		return;
+	}
+	snprintf(addr->sun_path, sizeof(addr->sun_path), KILO_SOCKET_FMT, (int) getuid());
+}
+
+/* Returns 1 if the process on the other end of fd runs as this user. */
+int editorPeerIsUser(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return 0;
+	return cred.uid == getuid();
+}
+
+/* nonzero when the attached client has gone away */
+int editorClientGone()
+{
+	char c;
+	if (E.client == -1) return 0;
+	int n = recv(E.client, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+void editorDetach()
+{
+	LOG_INFO("Detaching client %d.", E.client);
+
+	/* not disableRawMode(), the terminal may have gone with the client */
+	if (E.rawmode) tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
+	E.rawmode = 0;
+
+	/* the terminal belongs to the client, let go of it */
+	int null = open("/dev/null", O_RDWR);
+	if (null == -1) die("open");
+	dup2(null, STDIN_FILENO);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	/* closing the socket lets the client exit */
+	close(E.client);
+	E.client = -1;
+}
+
+/* Read a client's request, the terminal's descriptors followed by its
+ * arguments as NUL terminated strings. Returns the number of arguments. */
+int editorReadRequest(int cfd, int *fds, char **args, char ***argv)
+{
+	int len;
+	char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+	struct iovec iov = {&len, sizeof(len)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(cfd, &msg, 0) != sizeof(len)) return -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) return -1;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+	if (len < 0 || len > KILO_REQUEST_MAX) return -1;
+
+	*args = malloc(len + 1);
+	int got = 0, n;
+	while (got < len) {
+		n = read(cfd, *args + got, len - got);
+		if (n <= 0) return -1;
+		got += n;
+	}
+	(*args)[len] = '\0';
+
+	int argc = 0, i;
+	*argv = NULL;
+	for (i = 0; i < len; i += strlen(*args + i) + 1) {
+		*argv = realloc(*argv, sizeof(char *) * (argc + 1));
+		(*argv)[argc++] = *args + i;
+	}
+	return argc;
+}
+
+void editorServeClient(int cfd)
+{
+	int fds[2] = {-1, -1};
+	char *args = NULL;
+	char **argv = NULL;
+	int argc = editorReadRequest(cfd, fds, &args, &argv);
+	if (argc == -1 || !isatty(fds[0])) {
+		LOG_WARN("Dropping a client with a bad request.");
+		if (fds[0] != -1) close(fds[0]);
+		if (fds[1] != -1) close(fds[1]);
+		close(cfd);
+		free(args);
+		free(argv);
+		return;
+	}
+
+	dup2(fds[0], STDIN_FILENO);
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[0]);
+	close(fds[1]);
+	E.client = cfd;
+	LOG_INFO("Attached client %d with %d arguments.", cfd, argc);
+
+	if (enableRawMode() == -1 || editorUpdateWindowSize() == -1) {
+		LOG_ERROR("Can't set up the client's terminal: %s", strerror(errno));
+		editorDetach();
+		free(args);
+		free(argv);
+		return;
+	}
+	E.shadowvalid = 0;
+
+	/* bring the current buffer's state back into E.buf before looking
+	 * for buffers to reuse, then show it again from there */
+	int at = E.curbuf;
+	if (at != -1) editorStoreBuffer(&E.buf[at]);
+	int first = editorOpenArgs(argc, argv);
+	if (first != -1) at = first;
+	if (E.numbufs == 0) at = editorAddBuffer(NULL);
+	/* the help first, so a resident buffer's warnings replace it */
+	editorSetStatusMessage("Help: ^S save | ^Q detach | ^F find | ^N/^P buffer | ^R replace | ^Z undo");
+	E.curbuf = -1;
+	editorSwitchBuffer(at);
+	free(args);
+	free(argv);
+	E.quit = 0;
+	while (!E.quit) {
+		editorRefreshScreen();
+		editorProcessKeypress();
+	}
+	editorDetach();
+}
+
+int editorServe()
+{
+	struct sockaddr_un addr;
+	editorSocketPath(&addr);
+
+	/* a socket nobody accepts on was left over by a server that died */
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) die("socket");
+	if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "kilo: a server is already running on %s\n", addr.sun_path);
+		return EXIT_FAILURE;
+	}
+	close(sfd);
+	unlink(addr.sun_path);
+
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd == -1) die("socket");
+	mode_t mask = umask(077);
+	if (bind(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) die("bind");
+	umask(mask);
+	if (listen(sfd, 8) == -1) die("listen");
+	if (daemon(0, 0) == -1) die("daemon");
+
+	initLogFile();
+	initEditor();
+	LOG_INFO("Serving on %s", addr.sun_path);
+
+	while (1) {
+		/* failing clients, aborted connections included, are only logged */
+		int cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd == -1) {
+			if (errno != EINTR) LOG_WARN("accept failed: %s", strerror(errno));
+			continue;
+		}
+		if (!editorPeerIsUser(cfd)) {
+			LOG_WARN("Dropping a client run by another user.");
+			close(cfd);
+			continue;
+		}
+		editorServeClient(cfd);
+	}
+}
+
+/* Hand the terminal to a running server and wait until it is given back.
+ * Returns -1 when there is no server to attach to. */
+int editorAttach(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	editorSocketPath(&addr);
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) die("socket");
+	if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	/* the terminal is only handed to a server of our own */
+	if (!editorPeerIsUser(sfd)) {
+		fprintf(stderr, "kilo: %s is served by another user, not attaching\n", addr.sun_path);
+		close(sfd);
+		return EXIT_FAILURE;
+	}
+
+	/* the server has another working directory, so send absolute paths */
+	struct abuf args = ABUF_INIT;
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) die("getcwd");
+	int i;
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] != '/' && strcmp(argv[i], "-f") != 0) {
+			abAppend(&args, cwd, strlen(cwd));
+			abAppend(&args, "/", 1);
+		}
+		abAppend(&args, argv[i], strlen(argv[i]) + 1);
+	}
+
+	int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {&args.len, sizeof(args.len)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sfd, &msg, 0) != sizeof(args.len)) die("sendmsg");
+	if (args.len > 0 && write(sfd, args.b, args.len) != args.len) die("write");
+	abFree(&args);
+
+	/* the server closes the connection when the client detaches */
+	char c;
+	while (read(sfd, &c, 1) == -1 && errno == EINTR);
+	close(sfd);
+	return EXIT_SUCCESS;
+}
+
 /*** init ***/
 void initEditor()
 {
@@ -899,25 +3711,74 @@ void initEditor()
 	E.row = NULL;
 	E.dirty = 0;
 	E.filename = NULL;
+	E.buf = NULL;
+	E.numbufs = 0;
+	E.curbuf = -1;
+	E.undo = NULL;
+	E.undolen = 0;
+	E.undodirty = 0;
+	E.mark = -1;
+	E.yank = NULL;
+	E.yanklen = 0;
+	E.yankcut = 0;
+	E.yankbuf = -1;
+	E.yanklent = 0;
+	E.wrap = 0;
+	E.voff = 0;
+	E.wrapidx = NULL;
+	E.wrapvalid = 0;
+	E.wrapcols = 0;
+	E.follow = 0;
+	E.followoff = 0;
+	E.followino = 0;
+	E.followmtime.tv_sec = E.followmtime.tv_nsec = 0;
+	E.followpartial = 0;
+	E.ifd = -1;
+	E.iwd = -1;
+	E.idwd = -1;
+	E.arena = NULL;
+	E.arenalen = 0;
+	editorRxMarkDrop(NULL, -1);
+	E.gaprow = NULL;
+	E.shadow = NULL;
+	E.shadowlen = NULL;
+	E.shadowrows = 0;
+	E.shadowtop = 0;
+	E.shadowwrap = 0;
+	E.shadowvalid = 0;
+	E.findquery = NULL;
+	E.findregex = 0;
+	E.findre = NULL;
+	E.findprompt[0] = '\0';
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
-
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-	E.screenrows -= 2; /* For statusbar and msg */
+	/* not E.rawmode, main enables raw mode before initEditor runs */
+	E.quit = 0;
+	E.client = -1;
 }
 
 int main(int argc, char *argv[])
 {
+	if (argc > 1 && strcmp(argv[1], "--server") == 0) return editorServe();
+	if (argc > 1 && strcmp(argv[1], "--attach") == 0) {
+		/* without a server to attach to, just edit the files here */
+		int ret = editorAttach(argc - 2, argv + 2);
+		if (ret != -1) return ret;
+		argc--;
+		argv++;
+	}
+
 	initLogFile();
-	enableRawMode();
+	if (enableRawMode() == -1) die("enableRawMode");
 	initEditor();
-	if (argc >= 2) {
-		editorOpen(argv[1]);
-	}
+	if (editorUpdateWindowSize() == -1) die("getWindowSize");
+	editorOpenArgs(argc - 1, argv + 1);
+	if (E.numbufs == 0) editorAddBuffer(NULL);
+	editorSwitchBuffer(0);
 
-	editorSetStatusMessage("Help: Ctrl-S = save | Ctrl-Q = quit");
+	editorSetStatusMessage("Help: ^S save | ^Q quit | ^F find | ^N/^P buffer | ^R replace | ^Z undo");
 
-	while (1) {
+	while (!E.quit) {
 		editorRefreshScreen();
 		editorProcessKeypress();
 	}